@@ -57,7 +57,7 @@ char *common_init (const char *s)
         len += now;
         buffer[len] = 0;        
 
-        srandom (time (NULL));
+        rng_seed (time (NULL));
 
         return buffer;
 }
@@ -199,18 +199,68 @@ int vcompare (const void *v1, const void *v2)
         return cmp3 (v1, v2);
 }
 
+static uint64_t rng_state[4] = {
+        0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+        0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL,
+};
+
+static inline uint64_t rotl (uint64_t x, int k)
+{
+        return (x << k) | (x >> (64 - k));
+}
+
+/* SplitMix64, to spread a small seed over all of the state */
+static uint64_t splitmix64 (uint64_t *x)
+{
+        uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+void rng_seed (uint64_t seed)
+{
+        for (int i = 0; i < 4; i++)
+                rng_state[i] = splitmix64 (&seed);
+}
+
+uint64_t rng_next (void)
+{
+        uint64_t *s = rng_state;
+        uint64_t result = rotl (s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl (s[3], 45);
+        return result;
+}
+
+/* Lemire's multiply-and-reject, which rarely needs a second draw */
+uint64_t rng_below (uint64_t n)
+{
+        unsigned __int128 m = (unsigned __int128) rng_next () * n;
+
+        if ((uint64_t) m < n) {
+                uint64_t threshold = -n % n;
+                while ((uint64_t) m < threshold)
+                        m = (unsigned __int128) rng_next () * n;
+        }
+        return m >> 64;
+}
+
 /* Returns start through last-1 */
 int randrange (int start, int last)
 {
-        unsigned range;
         if (start > last) swap (start, last);
-        range = last - start;
-
-        return random () % range + start;
+        return start + (int) rng_below ((unsigned) (last - start));
 }
 
 double real_random(void)
 {
-        return random() / (double) RAND_MAX;
+        return (rng_next() >> 11) * (1.0 / (1ULL << 53));
 }
 
@@ -94,8 +94,8 @@ void _die (const char *func, unsigned line) __attribute__ ((noreturn));
 #define myalloc(x) ((x) = calloc (sizeof (*(x)), 1))
 #define myallocn(x,n) ((x) = calloc (sizeof (*(x)), n))
 #define myrealloc(x,n) ((x) = realloc ((x), sizeof (*(x)) * (n)))
-#define grow(x,m,f) ((m) > (f) ? 0 : ({\
-        while ((m) <= (f)) myrealloc ((x), (m) <<= 1); 1;}))
+#define grow(x,m,f) do {while ((m) <= (f)) myrealloc ((x), (m) <<= 1);} \
+        while(0)
 
 /* Floating point stuff */
 typedef double ftype_t;
@@ -151,9 +151,16 @@ int icompare (const void *v1, const void *v2); //!< int *
 int pcompare (const void *pv1, const void *pv2); //!< void **
 int vcompare (const void *v1, const void *v2); //!< void *
 
+/* Random numbers from xoshiro256**, which is fast and passes the
+ * usual statistical tests.  The sequence is the same on every run
+ * unless seeded; common_init() seeds it from the clock. */
+void rng_seed (uint64_t seed);
+uint64_t rng_next (void);
+uint64_t rng_below (uint64_t n); //!< 0 through n-1, unbiased; n > 0
+
 /* Returns start through last-1 */
 int randrange (int start, int last);
-double real_random(void);
+double real_random(void); //!< [0, 1)
 
 #define obstack_chunk_alloc malloc
 #define obstack_chunk_free free
@@ -0,0 +1,95 @@
+/*
+   endpoint.c: Compact IPv4:port addresses
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "endpoint.h"
+
+/* Parses a decimal number of at most "digits" digits, no larger than
+ * limit.  This is on the path for every advertised neighbor, so it
+ * avoids the locale-dependent ctype functions. */
+static inline const char *parse_number(const char *s, unsigned digits,
+                                       unsigned limit, unsigned *n)
+{
+        unsigned i, d;
+
+        *n = 0;
+        for (i = 0; i < digits && (d = (unsigned char) s[i] - '0') < 10; i++)
+                *n = *n * 10 + d;
+        if (!i || (unsigned) ((unsigned char) s[i] - '0') < 10) return NULL;
+        if (i > 1 && s[0] == '0') return NULL;
+        if (*n > limit) return NULL;
+        return s + i;
+}
+
+const char *endpoint_parse(const char *s, endpoint_t *ep)
+{
+        uint32_t ip = 0;
+        unsigned n;
+
+        for (int i = 0; i < 4; i++) {
+                if (!(s = parse_number(s, 3, 255, &n))) return NULL;
+                ip = (ip << 8) | n;
+                if (*s++ != (i < 3 ? '.' : ':')) return NULL;
+        }
+        if (!(s = parse_number(s, 5, 65535, &n))) return NULL;
+
+        *ep = endpoint_make(ip, n);
+        return s;
+}
+
+static const struct
+{
+        uint32_t net;
+        unsigned bits;
+        enum endpoint_class class;
+} special[] = {
+        { 0x00000000,  8, ENDPOINT_BOGON },     /* "This" network */
+        { 0x0a000000,  8, ENDPOINT_PRIVATE },   /* RFC 1918 */
+        { 0x64400000, 10, ENDPOINT_PRIVATE },   /* Carrier-grade NAT */
+        { 0x7f000000,  8, ENDPOINT_BOGON },     /* Loopback */
+        { 0xa9fe0000, 16, ENDPOINT_PRIVATE },   /* Link-local */
+        { 0xac100000, 12, ENDPOINT_PRIVATE },   /* RFC 1918 */
+        { 0xc0000000, 24, ENDPOINT_BOGON },     /* IETF protocol assignments */
+        { 0xc0000200, 24, ENDPOINT_BOGON },     /* TEST-NET-1 */
+        { 0xc0a80000, 16, ENDPOINT_PRIVATE },   /* RFC 1918 */
+        { 0xc6120000, 15, ENDPOINT_BOGON },     /* Benchmarking */
+        { 0xc6336400, 24, ENDPOINT_BOGON },     /* TEST-NET-2 */
+        { 0xcb007100, 24, ENDPOINT_BOGON },     /* TEST-NET-3 */
+        { 0xe0000000,  3, ENDPOINT_BOGON },     /* Multicast and reserved */
+};
+
+enum endpoint_class endpoint_class(endpoint_t ep)
+{
+        uint32_t ip = endpoint_ip(ep);
+
+        if (!endpoint_port(ep)) return ENDPOINT_BOGON;
+        for (unsigned i = 0; i < sizeof special / sizeof special[0]; i++)
+                if (ip >> (32 - special[i].bits)
+                    == special[i].net >> (32 - special[i].bits))
+                        return special[i].class;
+        return ENDPOINT_PUBLIC;
+}
+
+char *endpoint_format(endpoint_t ep, char *buf)
+{
+        uint32_t ip = endpoint_ip(ep);
+        sprintf(buf, "%u.%u.%u.%u:%u", ip >> 24, (ip >> 16) & 0xff,
+                (ip >> 8) & 0xff, ip & 0xff, endpoint_port(ep));
+        return buf;
+}
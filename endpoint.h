@@ -0,0 +1,60 @@
+/*
+   endpoint.h: Compact IPv4:port addresses, header for endpoint.c
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include "common.h"
+
+/*! An IPv4 address and port packed into the low 48 bits, address
+ *  first, both in host byte order.  Suitable as a hash key.
+ */
+typedef uint64_t endpoint_t;
+
+#define ENDPOINT_STRLEN 22      //!< "255.255.255.255:65535" plus NUL
+
+#define endpoint_make(ip, port) (((endpoint_t) (ip) << 16) | (port))
+#define endpoint_ip(ep) ((uint32_t) ((ep) >> 16))
+#define endpoint_port(ep) ((unsigned) ((ep) & 0xffff))
+
+/*! Parses a dotted-quad IP:port from the start of s.  On success,
+ *  stores the endpoint and returns a pointer just past it; otherwise
+ *  returns NULL.  Octets with leading zeros are rejected, since some
+ *  programs read them as octal.
+ */
+const char *endpoint_parse(const char *s, endpoint_t *ep);
+
+/*! Kinds of endpoints that are not worth contacting.  Private ones
+ *  may be reachable from somewhere, just not from here; bogons
+ *  aren't reachable from anywhere.
+ */
+enum endpoint_class
+{
+        ENDPOINT_PUBLIC = 0,
+        ENDPOINT_PRIVATE = 1,   //!< RFC 1918, shared (CGN) and link-local
+        ENDPOINT_BOGON = 2,     //!< Reserved, loopback, multicast, or port 0
+};
+
+enum endpoint_class endpoint_class(endpoint_t ep);
+
+//! Writes the endpoint as IP:port into buf, which must hold ENDPOINT_STRLEN
+char *endpoint_format(endpoint_t ep, char *buf);
+
+#endif
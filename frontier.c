@@ -0,0 +1,138 @@
+/*
+   frontier.c: A FIFO of 64-bit values that spills to disk
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <unistd.h>
+#include "frontier.h"
+#include "queue.h"
+
+#define CHUNK_LEN 65536
+
+struct chunk
+{
+        unsigned head, tail;
+        uint64_t x[CHUNK_LEN];
+};
+
+/* The queue is made of three parts, oldest first: full chunks in
+ * memory, chunks in the spill file, and the chunk being filled.  Once
+ * anything is in the file, newly filled chunks must go there too, to
+ * stay in order. */
+struct frontier
+{
+        struct queue *chunks;
+        FILE *spill;
+        off_t rpos, wpos;       //!< Byte offsets into spill
+        struct chunk *tail;
+        unsigned max_chunks;
+        uint64_t len;
+};
+
+struct frontier *frontier_new(size_t budget)
+{
+        struct frontier *f;
+        myalloc(f);
+        f->chunks = queue_new();
+        myalloc(f->tail);
+        f->max_chunks = max(2, budget / sizeof (struct chunk));
+        return f;
+}
+
+static void spill(struct frontier *f, struct chunk *c)
+{
+        size_t n = c->tail - c->head;
+
+        if (!f->spill && !(f->spill = tmpfile())) die();
+        if (0 > fseeko(f->spill, f->wpos, SEEK_SET)) die();
+        if (n != fwrite(&c->x[c->head], sizeof c->x[0], n, f->spill)) die();
+        f->wpos += n * sizeof c->x[0];
+}
+
+static struct chunk *unspill(struct frontier *f)
+{
+        struct chunk *c;
+        size_t n = min(CHUNK_LEN, (f->wpos - f->rpos) / sizeof c->x[0]);
+
+        myalloc(c);
+        if (0 > fseeko(f->spill, f->rpos, SEEK_SET)) die();
+        if (n != fread(c->x, sizeof c->x[0], n, f->spill)) die();
+        c->tail = n;
+        f->rpos += n * sizeof c->x[0];
+
+        /* Start over once the file has been read back */
+        if (f->rpos == f->wpos) {
+                f->rpos = f->wpos = 0;
+                if (0 > ftruncate(fileno(f->spill), 0)) die();
+        }
+        return c;
+}
+
+void frontier_push(struct frontier *f, uint64_t x)
+{
+        f->tail->x[f->tail->tail++] = x;
+        f->len++;
+        if (f->tail->tail < CHUNK_LEN) return;
+
+        if (f->rpos == f->wpos
+            && (unsigned) queue_len(f->chunks) + 2 <= f->max_chunks) {
+                queue_push(f->chunks, f->tail);
+                myalloc(f->tail);
+        } else {
+                spill(f, f->tail);
+                f->tail->head = f->tail->tail = 0;
+        }
+}
+
+bool frontier_pop(struct frontier *f, uint64_t *x)
+{
+        struct chunk *c;
+
+        if (!f->len) return False;
+
+        if (queue_empty(f->chunks) && f->rpos < f->wpos)
+                queue_push(f->chunks, unspill(f));
+        c = queue_empty(f->chunks) ? f->tail : queue_peek(f->chunks, 0);
+
+        *x = c->x[c->head++];
+        f->len--;
+        if (c->head < c->tail) return True;
+
+        if (c == f->tail) c->head = c->tail = 0;
+        else free(queue_pop(f->chunks));
+        return True;
+}
+
+uint64_t frontier_len(struct frontier *f)
+{
+        return f->len;
+}
+
+uint64_t frontier_spilled(struct frontier *f)
+{
+        return (f->wpos - f->rpos) / sizeof f->tail->x[0];
+}
+
+void frontier_delete(struct frontier *f)
+{
+        while (!queue_empty(f->chunks)) free(queue_pop(f->chunks));
+        queue_delete(f->chunks);
+        if (f->spill) fclose(f->spill);
+        free(f->tail);
+        free(f);
+}
@@ -0,0 +1,46 @@
+/*
+   frontier.h: A FIFO of 64-bit values that spills to disk, header for
+   frontier.c
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef FRONTIER_H
+#define FRONTIER_H
+
+#include "common.h"
+
+struct frontier;
+
+/*! Creates a queue that keeps at most about "budget" bytes in memory.
+ *  Beyond that, the middle of the queue is written to an anonymous
+ *  temporary file, in large chunks, and read back when it is reached.
+ */
+struct frontier *frontier_new (size_t budget);
+void frontier_push (struct frontier *f, uint64_t x);
+
+//! Returns False if the queue is empty
+bool frontier_pop (struct frontier *f, uint64_t *x);
+
+uint64_t frontier_len (struct frontier *f);
+
+//! How many of the queued values are on disk
+uint64_t frontier_spilled (struct frontier *f);
+
+void frontier_delete (struct frontier *f);
+
+#endif
@@ -20,25 +20,333 @@
 
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include "heap.h"
-#include "queue.h"
+#include "hash.h"
+#include "quantile.h"
+#include "endpoint.h"
+#include "frontier.h"
+#include "trace.h"
+#include "topo.h"
 
-static struct queue *queue;
-static float timeout = 10;
 static int max_connections = 4000;
 
+/* Times are integer nanoseconds on a monotonic clock, so they stay
+ * exact however long we run.  Durations are still given in seconds. */
+typedef int64_t nsec_t;
+
+#define NSEC_PER_SEC 1000000000LL
+
+static inline nsec_t to_nsec(double seconds)
+{
+        return seconds * NSEC_PER_SEC;
+}
+
+static inline double to_sec(nsec_t t)
+{
+        return (double) t / NSEC_PER_SEC;
+}
+
+/* Requests wait in one of several lanes, each ordered by deadline.
+ * When connections free up, the lanes are served in proportion to
+ * their weights, so walk steps never wait behind a flood of
+ * speculative or bootstrap requests.
+ */
+enum lane
+{
+        LANE_WALK,
+        LANE_SPECULATIVE,
+        LANE_BOOTSTRAP,
+        NUM_LANES
+};
+
+static const char *lane_names[NUM_LANES] = { "walk", "spec", "bootstrap" };
+static unsigned lane_weights[NUM_LANES] = { 16, 4, 1 };
+
+struct request
+{
+        heap_loc_t heap_loc;
+        struct client *client;  //!< Who to answer
+        char *addr;
+        endpoint_t ep;          //!< addr parsed, or HASH_EMPTY
+        enum lane lane;
+        nsec_t deadline;
+        nsec_t queued;          //!< When it arrived
+        nsec_t deferred;        //!< When it was rate limited, or 0
+        nsec_t ready;           //!< When its reserved token comes due
+        bool reserved;          //!< Already holds its /24's token
+        unsigned retries;       //!< After local failures
+        char *id;               //!< The driver's correlation id, or NULL
+        unsigned long seq;      //!< Breaks ties in arrival order
+};
+
+/* Each client keeps its own heap of requests per lane, so that the
+ * requests of a client that can't take more results stay put; the
+ * lanes share out the connections among the clients that can. */
+struct lane_queue
+{
+        unsigned len;           //!< Requests in the lane, over all clients
+        double pass;            //!< Stride scheduling virtual time
+};
+
+static struct lane_queue lanes[NUM_LANES];
+static unsigned num_queued = 0;
+
+#define STRIDE 1000000.0
+
+/* Rate limiting.  Connections are paced by a global token bucket and
+ * by one bucket per /24, so a burst of requests into one network
+ * doesn't look like a SYN flood.  A request whose /24 is out of
+ * tokens reserves the next one, driving the bucket negative, and waits
+ * in the deferred heap until that token comes due.  Then it goes back
+ * into its lane.  A rate of 0 means unlimited.
+ */
+struct bucket
+{
+        double tokens;
+        nsec_t last;            //!< When tokens was last brought up to date
+};
+
+static double global_rate = 0, global_burst = 0;
+static double prefix_rate = 0, prefix_burst = 0;
+static struct bucket global_bucket;
+static struct hash *prefix_buckets;
+static unsigned prune_at = 1024;
+static struct heap *deferred;
+static struct timer *rate_timer = NULL;
+
+/* How long rate-limited requests were held back, since the last
+ * statistics */
+static double defer_total = 0;
+static float defer_max = 0;
+static unsigned long defer_count = 0;
+
+/* Clients.  Requests come from a client, and each result goes back
+ * to the client that asked for it.  Normally the only client is the
+ * driver on stdin and stdout.  With -l, drivers connect over TCP or a
+ * Unix socket instead, and share the lanes, the rate limits, and the
+ * connection table.  A client that goes away takes its queued
+ * requests with it; its probes in progress finish unreported.
+ *
+ * Flow control is per client.  The driver grants credits with "G: n"
+ * lines, and each result we print uses one up.  A connection is only
+ * started if its client has a credit set aside for the result.  Until
+ * the first grant, credits are unlimited.  Results that don't need a
+ * connection, such as cancellations, may push credits below zero.
+ * Separately, if a driver falls behind reading our output, we stop
+ * reading its requests and starting its connections until it catches
+ * up.  A blocked client's requests wait in its lanes.
+ */
+struct client
+{
+        struct client *prev, *next;
+        struct file *in;                //!< NULL once the input is closed
+        struct file *out;
+        struct read_line *read_line;
+        bool use_credits;
+        long credits;
+        bool out_paused;
+        unsigned num_requests;          //!< Queued or deferred
+        unsigned num_conns;
+        struct heap *requests[NUM_LANES];
+        struct hash *latest;            //!< Last request queued per endpoint
+};
+
+static struct client *clients = NULL;
+static struct client *stdio_client;
+static const char *listen_addr = NULL;
+static unsigned out_high = 1 << 20;
+static unsigned out_low = 1 << 18;
+static unsigned num_conns = 0;
+
+/* Probes in progress, by endpoint.  A request for an address that is
+ * already being probed doesn't get a connection of its own; its
+ * client joins the probe's waiters, and each waiter gets a copy of
+ * the result.  Duplicates that arrive while the first request is
+ * still queued wait their turn and join the probe when they come up,
+ * so they keep their own lane, deadline, and credit check.
+ */
+static struct hash *in_flight;
+static unsigned long coalesced = 0;     //!< Since the last statistics
+
+/* Socket profile.  Connections are bound round-robin to the local
+ * sources, if any are given.  A source with a port range binds each
+ * connection to the next port in the range; otherwise the kernel
+ * picks the port when connecting, so it may reuse ports that are busy
+ * with other destinations.  With abortive_close, connections are
+ * reset rather than closed, which skips TIME_WAIT.  With fast_open,
+ * the request rides on the SYN when the peer supports TCP Fast Open.
+ */
+struct source
+{
+        struct in_addr addr;
+        unsigned lo, hi;        //!< Port range, or 0 for any
+        unsigned next;
+};
+
+static struct source *sources = NULL;
+static unsigned num_sources = 0;
+static bool abortive_close = False;
+static bool fast_open = False;
+
+#define BIND_TRIES 16
+
+/* Crawl mode.  Instead of taking requests on stdin, we visit every
+ * ultrapeer reachable from the seeds, breadth first.  Each address is
+ * remembered as a packed endpoint, so a crawl of millions of peers
+ * takes tens of megabytes for the visited set.  Addresses waiting to
+ * be visited are kept in a frontier that spills to disk once it
+ * exceeds crawl_budget.  Only a connection table's worth of them is
+ * turned into requests at a time.
+ */
+static struct hash_set *visited = NULL;
+static struct frontier *frontier;
+static const char *crawl_seeds = NULL;
+static size_t crawl_budget = 64 << 20;
+
+/* Advertised neighbors that can't be contacted are dropped before
+ * they're reported: malformed entries, the peer itself, and whatever
+ * endpoint classes are in filter_classes.  The driver makes the same
+ * checks, but this saves it the trouble.
+ */
+static unsigned filter_classes = ENDPOINT_PRIVATE | ENDPOINT_BOGON;
+static bool filter_self = True;
+static bool filter_malformed = True;
+static unsigned long filter_seen = 0, filter_dropped = 0;
+
+/* Which parts of a result to report.  Headers for the others are
+ * skipped as they arrive, without being parsed or saved. */
+enum field
+{
+        FIELD_PEERS = 1,
+        FIELD_LEAVES = 2,
+        FIELD_AGENT = 4,
+};
+
+static unsigned fields = FIELD_PEERS | FIELD_LEAVES | FIELD_AGENT;
+
+/* Early completion.  Some servents trickle headers we don't use, or
+ * stall before the blank line that ends the handshake.  With
+ * early_complete, a probe is finished as soon as the peer type and
+ * every field we report have arrived, and a probe that times out in
+ * the headers after the peer type and some field arrived reports what
+ * it has rather than failing.  A field split across several header
+ * lines may be cut short.
+ */
+static bool early_complete = False;
+static unsigned long early_count = 0, partial_count = 0;
+
+/* With topo_out, the topology found by each successful probe of the
+ * network is appended to a compact log, for topo-compact to turn into
+ * a snapshot later. */
+static struct topo *topo_out = NULL;
+
+/* Failure classes.  Every failure is reported with its class in
+ * brackets ahead of the message, so the driver can tell what happened
+ * without parsing the text.  A probe that couldn't start for want of
+ * local resources (file descriptors, ports, buffers) says nothing
+ * about the peer, so it is tried again after a jittered backoff, up
+ * to local_retries times, before it is reported as local.
+ */
+enum failure
+{
+        FAIL_LOCAL,             //!< Our own resources ran short
+        FAIL_REFUSED,           //!< The peer refused or reset us
+        FAIL_UNREACHABLE,       //!< The network says there's no route
+        FAIL_TIMEOUT,           //!< Nothing came back in time
+        FAIL_DROPPED,           //!< The peer closed mid-handshake
+        FAIL_PROTOCOL,          //!< The peer answered with nonsense
+        FAIL_INVALID,           //!< Not an address we can probe
+        FAIL_CANCELLED,
+        FAIL_OTHER,
+        NUM_FAILURES
+};
+
+static const char *failure_names[NUM_FAILURES] = {
+        "local", "refused", "unreachable", "timeout", "dropped",
+        "protocol", "invalid", "cancelled", "failed"
+};
+
+static unsigned long failure_counts[NUM_FAILURES];
+static unsigned long retried = 0;       //!< Both since the last statistics
+static unsigned local_retries = 4;
+
+#define RETRY_DELAY 0.05        //!< Seconds before the first local retry
+
+/* Record and replay.  With trace_out, every request and every result
+ * from the network goes into a binary trace.  With replaying, results
+ * come from a trace instead of the network: each address gets its
+ * recorded results in turn, after the recorded time multiplied by
+ * replay_scale.  Replayed requests still go through the lanes, the
+ * rate limits, and the connection limit.
+ */
+struct replay_result
+{
+        struct replay_result *next;     //!< Another result for the address
+        const char *peer_type;          //!< NULL for a failure
+        char *text;                     //!< User agent or failure message
+        char *peers;
+        char *leaves;
+        nsec_t duration;
+};
+
+struct replay_addr
+{
+        struct replay_result *first;
+        struct replay_result *next_up;
+};
+
+static struct trace *trace_out = NULL;
+static bool replaying = False;
+static struct hash *replay_addrs;
+static double replay_scale = 1;
+
+/* How long requests wait in the lanes, since the last statistics */
+static double wait_total = 0, wait_max = 0;
+static unsigned long wait_count = 0;
+
+/* Each phase of a probe gets its own deadline.  Once enough probes
+ * have succeeded, a deadline adapts to timeout_factor times the
+ * TIMEOUT_QUANTILE of recent successful phase times, clamped to
+ * [min_timeout, timeout].  A timeout_factor of 0 disables adaptation.
+ */
+enum phase
+{
+        PHASE_CONNECT,          //!< connect() until the request is sent
+        PHASE_FIRST_BYTE,       //!< request sent until the status line
+        PHASE_HEADER,           //!< between subsequent header lines
+        NUM_PHASES
+};
+
+static const char *phase_names[NUM_PHASES] = { "connect", "first", "header" };
+static float timeout = 10;
+static float min_timeout = 0.5;
+static float timeout_factor = 3;
+static float timeouts[NUM_PHASES];
+static struct quantile *phase_times[NUM_PHASES];
+static float stats_interval = 0;
+
+#define TIMEOUT_QUANTILE 0.99
+#define TIMEOUT_MIN_SAMPLES 100
+#define TIMEOUT_HALFLIFE 1000
+
 static void maybe_dequeue(void);
+static void flow_control(void);
+static void crawl_feed(void);
+static void replay_conn_new(struct request *request);
 
 struct timer
 {
         heap_loc_t heap_loc;
-        float time;
+        nsec_t time;
         void (*func)(void *data);
         void *data;
 };
@@ -61,33 +369,77 @@ static struct pollfd *pollfds;
 static struct event_handler **event_handlers;
 static int max_pollfds;
 static int num_pollfds;
-static unsigned start_time;
 
-float get_now(void)
+/* Timers that are always pending, which shouldn't keep the main loop
+ * running by themselves */
+static unsigned idle_timers = 0;
+
+/* The clock is read once per trip through the main loop, rather than
+ * every time a timer is set, so everything handled in one trip sees
+ * the same time.  A coarse clock is cheaper to read still. */
+static clockid_t clock_id = CLOCK_MONOTONIC;
+static bool coarse_clock = False;
+static nsec_t loop_now;
+
+static void update_now(void)
 {
         struct timespec timespec;
-        if (0 > clock_gettime(CLOCK_MONOTONIC, &timespec)) die();
-        return (timespec.tv_sec - start_time) + timespec.tv_nsec/1000000000.0;
+        if (0 > clock_gettime(clock_id, &timespec)) die();
+        loop_now = timespec.tv_sec * NSEC_PER_SEC + timespec.tv_nsec;
+}
+
+nsec_t get_now(void)
+{
+        return loop_now;
+}
+
+int request_cmp(const void *v1, const void *v2)
+{
+        const struct request *r1 = v1, *r2 = v2;
+        if (r1->deadline != r2->deadline)
+                return cmp3(r1->deadline, r2->deadline);
+        return cmp3(r1->seq, r2->seq);
+}
+
+int deferred_cmp(const void *v1, const void *v2)
+{
+        const struct request *r1 = v1, *r2 = v2;
+        if (r1->ready != r2->ready)
+                return cmp3(r1->ready, r2->ready);
+        return cmp3(r1->seq, r2->seq);
 }
 
 void init(void)
 {
         struct timespec timespec;
 
-        queue = queue_new();
-
-        if (0 > clock_getres(CLOCK_MONOTONIC, &timespec)) die();
+        deferred = heap_new(deferred_cmp, offsetof(struct request, heap_loc));
+        prefix_buckets = hash_new();
+        in_flight = hash_new();
+        global_bucket.tokens = global_burst;
 
         /* 5 ms resolution should be _plenty_ */
+#ifdef CLOCK_MONOTONIC_COARSE
+        if (coarse_clock) {
+                if (0 > clock_getres(CLOCK_MONOTONIC_COARSE, &timespec)) die();
+                if (!timespec.tv_sec && timespec.tv_nsec <= 5000000)
+                        clock_id = CLOCK_MONOTONIC_COARSE;
+        }
+#endif
+        if (0 > clock_getres(clock_id, &timespec)) die();
         if (timespec.tv_sec || timespec.tv_nsec > 5000000) die();
 
-        start_time = 0;
-        start_time = get_now();
+        update_now();
         
         if (timers) die();
 
         timers = heap_new(timer_cmp, offsetof(struct timer, heap_loc));
 
+        for (int i = 0; i < NUM_PHASES; i++) {
+                timeouts[i] = timeout;
+                phase_times[i] = quantile_new(0.001, 100, 8, TIMEOUT_HALFLIFE);
+        }
+
         max_pollfds = 128;
         num_pollfds = 0;
         myallocn(pollfds, max_pollfds);
@@ -99,7 +451,7 @@ struct timer *timer_new(float delay_seconds, void (*func) (void *data),
 {
         struct timer *timer;
         myalloc(timer);
-        timer->time = get_now() + delay_seconds;
+        timer->time = get_now() + to_nsec(delay_seconds);
         timer->func = func;
         timer->data = data;
         heap_insert(timers, timer);
@@ -116,7 +468,7 @@ void timer_cancel(struct timer *timer)
 
 void timer_reset(struct timer *timer, float delay_seconds)
 {
-        timer->time = get_now() + delay_seconds;
+        timer->time = get_now() + to_nsec(delay_seconds);
         heap_remove(timers, timer);
         heap_insert(timers, timer);
 }
@@ -162,26 +514,46 @@ void event_handler_delete(struct event_handler *event_handler)
         num_pollfds--;
 }
 
+/* Set by SIGTERM or SIGINT, which is how the driver stops us.  The
+ * main loop finishes, so that the trace and topology logs are closed
+ * on a record boundary. */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_handler(int sig __unused)
+{
+        stopping = 1;
+}
+
 void main_loop(void)
 {
         int n;
         struct timer *timer;
-        int delay;
+        nsec_t delay;
 
-        while (num_pollfds > 1 || heap_len(timers) > 1
-               || pollfds[0].events & POLLOUT) {
+        while (!stopping
+               && (num_pollfds > 1 || heap_len(timers) > idle_timers
+                   || pollfds[0].events & POLLOUT || num_queued)) {
+                update_now();
                 if (heap_empty(timers)) {
                         timer = NULL;
                         delay = -1;
                 } else {
                         timer = heap_peek(timers);
-                        delay = (timer->time - get_now()) * 1000;
+                        delay = timer->time - get_now();
                 }
                 
                 if (timer && delay <= 0)
                         n = 0;
-                else
+                else {
+                        /* Round up, so we don't wake up just early */
+                        if (delay > 0) delay = (delay + 999999) / 1000000;
                         n = poll(pollfds, num_pollfds, delay);
+                        update_now();
+                        if (0 > n) {
+                                if (errno != EINTR) die();
+                                continue;
+                        }
+                }
 
                 if (!n) {
                         timer = heap_extract_min(timers);
@@ -203,6 +575,8 @@ void main_loop(void)
                 }
 
         cont:
+                flow_control();
+                if (visited) crawl_feed();
                 maybe_dequeue();                
         }
 }
@@ -222,6 +596,8 @@ struct file
         void *err_data;
         void (*read_handler)(void *data);
         void *read_data;
+        void (*drain_handler)(void *data); //!< Called when wbuf empties
+        void *drain_data;
 };
 
 #define BLOCK_SIZE 4096
@@ -305,18 +681,43 @@ static void _file_delete(struct file *file)
         free(file);
 }
 
-static bool in_file_handler = False;
+/* Writes out as much of wbuf as possible.  Returns False on error. */
+static bool file_flush(struct file *file)
+{
+        int n;
+
+        n = write(file->event_handler->pollfd->fd, file->wbuf, file->wlen);
+        if (!n) die();
+        if (n < 0) {
+                /* EINPROGRESS means a fast-open SYN went out without
+                 * our data, and EAGAIN can only happen if we weren't
+                 * called from poll().  Either way, wait for POLLOUT. */
+                return errno == EINTR || errno == EINPROGRESS
+                        || errno == EAGAIN;
+        }
+        if ((unsigned) n > file->wlen) die();
+
+        memmove(file->wbuf, &file->wbuf[n], file->wlen - n);
+        file->wlen -= n;
+        if (file->wlen) return True;
+
+        file->event_handler->pollfd->events &= ~POLLOUT;
+        if (file->drain_handler) file->drain_handler(file->drain_data);
+        return True;
+}
+
+static struct file *handling_file = NULL;
 void file_delete(struct file *file)
 {
-        /* Delay actual freeing of resources */
+        /* Delay actual freeing of resources if we're in its handler */
         file->deleted = True;
-        if (!in_file_handler) _file_delete(file);
+        if (file != handling_file) _file_delete(file);
 }
 
 void file_handler(void *vfile)
 {
         struct file *file = vfile;
-        in_file_handler = True;
+        handling_file = file;
         short revents = file->event_handler->pollfd->revents;
 
         if (revents & (POLLERR | POLLHUP | POLLNVAL | POLLPRI)) {
@@ -326,22 +727,8 @@ void file_handler(void *vfile)
         }
 
         if (revents & POLLOUT) {
-                int n;
                 if (!file->wlen) die();
-
-                n = write(file->event_handler->pollfd->fd,
-                          file->wbuf, file->wlen);
-                if (!n) die();
-                if (n < 0) {
-                        if (errno == EAGAIN) die();
-                        if (errno != EINTR) {
-                                goto error;
-                        }
-                } else if ((unsigned) n > file->wlen) die();
-                else {
-                        memmove(file->wbuf, &file->wbuf[n], file->wlen - n);
-                        file->wlen -= n;
-                }
+                if (!file_flush(file)) goto error;
         }
 
         if (revents & POLLIN) {
@@ -376,7 +763,7 @@ void file_handler(void *vfile)
                         _file_delete(file);
                 }
         }
-        in_file_handler = False;
+        handling_file = NULL;
 }
 
 struct file *file_stdout = NULL;
@@ -443,8 +830,19 @@ void read_line_delete(struct read_line *read_line)
         free(read_line);
 }
 
+/* A request being served by a probe */
+struct waiter
+{
+        struct client *client;
+        char *id;               //!< The driver's correlation id, or NULL
+        nsec_t queued;          //!< When the request arrived
+};
+
 struct gnutella_conn
 {
+        struct gnutella_conn *prev, *next;
+        struct waiter *waiters;
+        unsigned num_waiters, max_waiters;
         struct read_line *read_line;
         struct file *file;
         char *addr;
@@ -453,30 +851,220 @@ struct gnutella_conn
         char *neighbors;
         char *leafs;
         struct timer *timer;
+        enum phase phase;
+        nsec_t phase_start;
+        nsec_t start;
+        bool fast_open;
+        unsigned seen;                  //!< Fields that have arrived
+        nsec_t connected;               //!< When the connection came up
+        endpoint_t ep;
+        struct replay_result *replay;
 };
 
+static struct gnutella_conn *conns = NULL;
+
 void gnutella_delete(struct gnutella_conn *conn)
 {
-        read_line_delete(conn->read_line);
-        file_delete(conn->file);
+        if (conn->prev) conn->prev->next = conn->next;
+        else conns = conn->next;
+        if (conn->next) conn->next->prev = conn->prev;
+        num_conns--;
+        for (unsigned i = 0; i < conn->num_waiters; i++) {
+                conn->waiters[i].client->num_conns--;
+                free(conn->waiters[i].id);
+        }
+        if (hash_get(in_flight, conn->ep) == conn)
+                hash_remove(in_flight, conn->ep);
+        if (abortive_close && conn->file) {
+                /* Send a RST, so the socket skips TIME_WAIT */
+                struct linger linger = { 1, 0 };
+                setsockopt(conn->file->event_handler->pollfd->fd,
+                           SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+        }
+        if (conn->file) {
+                read_line_delete(conn->read_line);
+                file_delete(conn->file);
+        }
         free(conn->addr);
         if (conn->user_agent) free(conn->user_agent);
         if (conn->neighbors) free(conn->neighbors);
         if (conn->leafs) free(conn->leafs);
         timer_cancel(conn->timer);
+        free(conn->waiters);
         free(conn);
 }
 
-static void report_error(const char *addr, const char *format, ...)
+static void result_printed(struct client *client)
+{
+        client->credits--;
+}
+
+static enum failure errno_failure(int err)
+{
+        switch (err) {
+        case EAGAIN: case EADDRINUSE: case EADDRNOTAVAIL: case EMFILE:
+        case ENFILE: case ENOBUFS: case ENOMEM:
+                return FAIL_LOCAL;
+        case ECONNREFUSED: case ECONNRESET:
+                return FAIL_REFUSED;
+        case EHOSTUNREACH: case ENETUNREACH: case EHOSTDOWN: case ENETDOWN:
+                return FAIL_UNREACHABLE;
+        case ETIMEDOUT:
+                return FAIL_TIMEOUT;
+        case EPIPE:
+                return FAIL_DROPPED;
+        default:
+                return FAIL_OTHER;
+        }
+}
+
+/* Splits the class off a failure message, as recorded in a trace.
+ * Older traces have none. */
+static const char *failure_parse(const char *msg, enum failure *failure)
+{
+        *failure = FAIL_OTHER;
+        if (msg[0] != '[') return msg;
+        for (int i = 0; i < NUM_FAILURES; i++) {
+                size_t len = strlen(failure_names[i]);
+                if (0 == strncmp(msg + 1, failure_names[i], len)
+                    && 0 == strncmp(msg + 1 + len, "] ", 2)) {
+                        *failure = i;
+                        return msg + len + 3;
+                }
+        }
+        return msg;
+}
+
+static void report_error(struct client *client, const char *addr,
+                         enum failure failure, const char *format, ...)
 {
         va_list ap;
+        if (!client) return;
+        result_printed(client);
+        failure_counts[failure]++;
         va_start(ap, format);
-        file_printf(file_stdout, "R: %s(): ", addr);
-        file_vprintf(file_stdout, format, ap);
-        file_write(file_stdout, "\n", 1);
+        file_printf(client->out, "R: %s(): [%s] ", addr,
+                    failure_names[failure]);
+        file_vprintf(client->out, format, ap);
+        file_write(client->out, "\n", 1);
         va_end(ap);        
 }
 
+/* Reports how long the waiter's request spent queued here, connecting,
+ * and waiting for the answer, ahead of the result.  A request that
+ * joined a probe already under way is charged only from its arrival.
+ */
+static void report_profile(struct gnutella_conn *conn, struct waiter *w)
+{
+        nsec_t now = get_now();
+        nsec_t start = max(conn->start, w->queued);
+        nsec_t connected = max(conn->connected ? conn->connected : now,
+                               start);
+
+        if (!w->id) return;
+        file_printf(w->client->out, "P: %s %.6f %.6f %.6f\n", w->id,
+                    to_sec(start - w->queued), to_sec(connected - start),
+                    to_sec(now - connected));
+}
+
+/* Parses a space-separated endpoint list, for trace and topology
+ * records */
+static endpoint_t *trace_endpoints(const char *list, unsigned *n)
+{
+        endpoint_t *eps;
+        unsigned max = 16;
+
+        myallocn(eps, max);
+        *n = 0;
+        while (list && *list) {
+                endpoint_t ep;
+                const char *next = endpoint_parse(list, &ep);
+                if (next) {
+                        grow(eps, max, *n);
+                        eps[(*n)++] = ep;
+                        list = next;
+                }
+                while (*list && *list != ' ') list++;
+                while (*list == ' ') list++;
+        }
+        return eps;
+}
+
+static void trace_result(endpoint_t ep, nsec_t duration, const char *failure,
+                         struct gnutella_conn *conn)
+{
+        struct trace_record r;
+
+        memset(&r, 0, sizeof r);
+        r.time = get_now();
+        r.ep = ep;
+        r.duration = duration;
+        if (failure) {
+                r.kind = TRACE_FAILURE;
+                r.text = (char *) failure;
+        } else {
+                r.kind = conn->peer_type[0] == 'U' ? TRACE_ULTRAPEER
+                        : conn->peer_type[0] == 'L' ? TRACE_LEAF : TRACE_PEER;
+                r.text = conn->user_agent;
+                r.peers = trace_endpoints(conn->neighbors, &r.num_peers);
+                r.leaves = trace_endpoints(conn->leafs, &r.num_leaves);
+        }
+        trace_write(trace_out, &r);
+        free(r.peers);
+        free(r.leaves);
+}
+
+static void trace_failure(endpoint_t ep, nsec_t duration,
+                          enum failure failure, const char *msg)
+{
+        char *text;
+
+        if (0 > asprintf(&text, "[%s] %s", failure_names[failure], msg))
+                die();
+        trace_result(ep, duration, text, NULL);
+        free(text);
+}
+
+static void topo_result(struct gnutella_conn *conn)
+{
+        struct topo_record r;
+        struct timespec now;
+
+        if (0 > clock_gettime(CLOCK_REALTIME, &now)) die();
+        memset(&r, 0, sizeof r);
+        r.kind = conn->peer_type[0] == 'U' ? TOPO_ULTRAPEER
+                : conn->peer_type[0] == 'L' ? TOPO_LEAF : TOPO_PEER;
+        r.time = (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        r.ep = conn->ep;
+        r.peers = trace_endpoints(conn->neighbors, &r.num_peers);
+        r.leaves = trace_endpoints(conn->leafs, &r.num_leaves);
+        topo_write(topo_out, &r);
+        free(r.peers);
+        free(r.leaves);
+}
+
+/* Reports that the probe failed, and gets rid of the connection */
+static void conn_fail(struct gnutella_conn *conn, enum failure failure,
+                      const char *format, ...)
+{
+        va_list ap;
+        char *msg;
+
+        va_start(ap, format);
+        if (0 > vasprintf(&msg, format, ap)) die();
+        va_end(ap);
+
+        for (unsigned i = 0; i < conn->num_waiters; i++) {
+                report_profile(conn, &conn->waiters[i]);
+                report_error(conn->waiters[i].client, conn->addr, failure,
+                             "%s", msg);
+        }
+        if (trace_out) trace_failure(conn->ep, get_now() - conn->start,
+                                     failure, msg);
+        free(msg);
+        gnutella_delete(conn);
+}
+
 void gnutella_err_handler(void *vconn)
 {
         struct gnutella_conn *conn = vconn;
@@ -484,115 +1072,751 @@ void gnutella_err_handler(void *vconn)
         socklen_t optlen = sizeof err;
         if (0 > getsockopt(conn->file->event_handler->pollfd->fd,
                            SOL_SOCKET, SO_ERROR, &err, &optlen)) die();
-        if (err) report_error(conn->addr, "Failed: %s", strerror(err));
-        else report_error(conn->addr, "Connection Dropped");
-        gnutella_delete(conn);
+        if (err) conn_fail(conn, errno_failure(err), "Failed: %s",
+                           strerror(err));
+        else conn_fail(conn, FAIL_DROPPED, "Connection Dropped");
 }
 
 static void gnutella_timeout(void *vconn);
+static void gnutella_drain_handler(void *vconn);
+static void gnutella_line_handler_done(struct gnutella_conn *conn);
 void gnutella_line_handler1(void *bconn, char *line);
 void gnutella_line_handler2(void *bconn, char *line);
-void gnutella_conn_new(char *addr);
+static bool gnutella_conn_new(struct request *request);
+
+static bool client_blocked(struct client *client);
+
+/* Returns the earliest-deadline request, among clients that aren't
+ * blocked, from the lane furthest behind its weighted share that has
+ * one, or NULL */
+static struct request *request_next(void)
+{
+        struct request *best = NULL;
+
+        for (int i = 0; i < NUM_LANES; i++) {
+                struct request *next = NULL;
+
+                if (!lanes[i].len) continue;
+                if (best && lanes[best->lane].pass <= lanes[i].pass)
+                        continue;
+                for (struct client *c = clients; c; c = c->next) {
+                        struct request *request;
+                        if (heap_empty(c->requests[i]) || client_blocked(c))
+                                continue;
+                        request = heap_peek(c->requests[i]);
+                        if (!next || request_cmp(request, next) < 0)
+                                next = request;
+                }
+                if (next) best = next;
+        }
+        return best;
+}
+
+/* Forgets the request as its client's latest for its endpoint, once
+ * it leaves the lanes */
+static void request_unindex(struct request *request)
+{
+        struct hash *latest = request->client->latest;
+
+        if (request->ep != HASH_EMPTY
+            && hash_get(latest, request->ep) == request)
+                hash_remove(latest, request->ep);
+}
+
+/* Takes the request returned by request_next() out of its lane */
+static void request_pop(struct request *request)
+{
+        struct lane_queue *l = &lanes[request->lane];
+
+        l->pass += STRIDE / lane_weights[request->lane];
+        l->len--;
+        num_queued--;
+        heap_extract_min(request->client->requests[request->lane]);
+        request_unindex(request);
+}
+
+static void request_push(struct request *request)
+{
+        struct lane_queue *l = &lanes[request->lane];
+
+        /* An idle lane doesn't get to bank its unused share */
+        if (!l->len) {
+                for (int i = 0; i < NUM_LANES; i++)
+                        if (lanes[i].len)
+                                l->pass = max(l->pass, lanes[i].pass);
+        }
+
+        heap_insert(request->client->requests[request->lane], request);
+        if (request->ep != HASH_EMPTY)
+                hash_put(request->client->latest, request->ep, request);
+        l->len++;
+        num_queued++;
+}
+
+/* Brings a bucket up to date, and returns how long until it has a
+ * token, or 0 if it has one now */
+static float bucket_wait(struct bucket *bucket, double rate, double burst,
+                         nsec_t now)
+{
+        bucket->tokens = min(burst, bucket->tokens
+                             + rate * to_sec(now - bucket->last));
+        bucket->last = now;
+        if (bucket->tokens >= 1) return 0;
+        return (1 - bucket->tokens) / rate;
+}
+
+/* Buckets that have refilled are the same as new ones, so they can
+ * be forgotten */
+static void prune_buckets(nsec_t now)
+{
+        uint64_t *full, key;
+        struct bucket *bucket;
+        unsigned pos = 0, n = 0;
+
+        myallocn(full, hash_len(prefix_buckets));
+        while (hash_next(prefix_buckets, &pos, &key, (void **) &bucket))
+                if (!bucket_wait(bucket, prefix_rate, prefix_burst, now)
+                    && bucket->tokens >= prefix_burst)
+                        full[n++] = key;
+        for (unsigned i = 0; i < n; i++)
+                free(hash_remove(prefix_buckets, full[i]));
+        free(full);
+
+        prune_at = max(1024, 2 * hash_len(prefix_buckets));
+}
+
+/* Returns the request's /24 bucket, or NULL if it isn't limited */
+static struct bucket *prefix_bucket(const char *addr, nsec_t now)
+{
+        struct bucket *bucket;
+        endpoint_t ep;
+        uint32_t prefix;
+
+        if (!prefix_rate) return NULL;
+        if (!endpoint_parse(addr, &ep))
+                return NULL; /* gnutella_conn_new() will complain */
+        prefix = endpoint_ip(ep) >> 8;
+
+        bucket = hash_get(prefix_buckets, prefix);
+        if (bucket) return bucket;
+
+        if (hash_len(prefix_buckets) >= prune_at) prune_buckets(now);
+        myalloc(bucket);
+        bucket->tokens = prefix_burst;
+        bucket->last = now;
+        hash_put(prefix_buckets, prefix, bucket);
+        return bucket;
+}
+
+static void rate_wakeup(void *vdata __unused)
+{
+        rate_timer = NULL;
+}
+
+/* Makes sure that maybe_dequeue() runs again within delay seconds */
+static void rate_wakeup_in(float delay, nsec_t now)
+{
+        if (rate_timer) {
+                if (rate_timer->time <= now + to_nsec(delay)) return;
+                timer_reset(rate_timer, delay);
+        } else
+                rate_timer = timer_new(delay, rate_wakeup, NULL);
+}
+
+static bool client_blocked(struct client *client)
+{
+        return client->out_paused
+                || (client->use_credits
+                    && (long) client->num_conns >= client->credits);
+}
+
+/* Returns the probe in progress for addr, if there is one */
+static struct gnutella_conn *conn_find(const char *addr)
+{
+        endpoint_t ep;
+        const char *end = endpoint_parse(addr, &ep);
+
+        if (!end || *end) return NULL;
+        return hash_get(in_flight, ep);
+}
+
+/* Adds the request to the probe's waiters, taking its id */
+static void conn_attach(struct gnutella_conn *conn, struct request *request)
+{
+        struct waiter *w;
+
+        grow(conn->waiters, conn->max_waiters, conn->num_waiters);
+        w = &conn->waiters[conn->num_waiters++];
+        w->client = request->client;
+        w->id = request->id;
+        w->queued = request->queued;
+        request->id = NULL;
+        request->client->num_conns++;
+}
+
+/* Serves the request from a probe already in progress, if possible.
+ * Frees the request if it does. */
+static bool request_coalesce(struct request *request)
+{
+        struct gnutella_conn *conn = conn_find(request->addr);
+
+        if (!conn) return False;
+        conn_attach(conn, request);
+        request->client->num_requests--;
+        coalesced++;
+        free(request->addr);
+        free(request);
+        return True;
+}
 
 static void maybe_dequeue(void)
 {
-        if (num_pollfds >= max_connections) return;
-        if (queue_empty(queue)) return;
+        struct request *request;
+        struct bucket *bucket;
+        nsec_t now = get_now();
+        float wait, waited;
+
+        while (!heap_empty(deferred)) {
+                request = heap_peek(deferred);
+                if (request->ready > now) {
+                        rate_wakeup_in(to_sec(request->ready - now), now);
+                        break;
+                }
+                request_push(heap_extract_min(deferred));
+        }
+
+        while ((replaying ? (int) num_conns + 2 : num_pollfds)
+               < max_connections && (request = request_next())) {
+                /* Make sure there are still file descriptors available */
+                int fd = open("/dev/null", O_RDONLY);
+                if (0 > fd) return;
+                close(fd);
+
+                if (global_rate && (wait = bucket_wait(&global_bucket,
+                                                       global_rate,
+                                                       global_burst, now))) {
+                        rate_wakeup_in(wait, now);
+                        return;
+                }
+
+                request_pop(request);
+                if (request_coalesce(request)) continue;
+                bucket = request->reserved ? NULL
+                        : prefix_bucket(request->addr, now);
+                if (bucket) {
+                        wait = bucket_wait(bucket, prefix_rate,
+                                           prefix_burst, now);
+                        bucket->tokens--;
+                        if (wait) {
+                                request->deferred = now;
+                                request->ready = now + to_nsec(wait);
+                                request->reserved = True;
+                                heap_insert(deferred, request);
+                                rate_wakeup_in(wait, now);
+                                continue;
+                        }
+                }
+
+                if (global_rate) global_bucket.tokens--;
+                if (request->deferred) {
+                        waited = to_sec(now - request->deferred);
+                        defer_total += waited;
+                        defer_max = max(defer_max, waited);
+                        defer_count++;
+                }
+                waited = to_sec(now - request->queued);
+                wait_total += waited;
+                wait_max = max(wait_max, waited);
+                wait_count++;
+                request->client->num_requests--;
+                if (replaying) replay_conn_new(request);
+                else if (!gnutella_conn_new(request)) continue;
+                free(request->id);
+                free(request);
+        }
+}
+
+/* Moves the client's request for the same address that waits in a
+ * lower lane up to this request's lane and deadline, just ahead of it,
+ * so that it joins their connection rather than waiting behind them.
+ * An address is only asked for again in a higher lane, so the latest
+ * request for it is the only one that can be lower. */
+static void request_promote(struct request *request)
+{
+        struct request *old;
+
+        if (request->ep == HASH_EMPTY) return;
+        old = hash_get(request->client->latest, request->ep);
+        if (!old || old->lane <= request->lane) return;
+        heap_remove(old->client->requests[old->lane], old);
+        lanes[old->lane].len--;
+        num_queued--;
+        old->lane = request->lane;
+        old->deadline = request->deadline;
+        request_push(old);
+}
 
-        /* Make sure there are still file descriptors available */
-        int fd = open("/dev/null", O_RDONLY);
-        if (0 > fd) return;
-        close(fd);
+void gnutella_conn_queue(struct client *client, const char *caddr,
+                         enum lane lane, float deadline, const char *id)
+{
+        static unsigned long seq = 0;
+        struct request *request;
+        const char *end;
+
+        myalloc(request);
+        request->client = client;
+        client->num_requests++;
+        request->addr = strdup(caddr);
+        end = endpoint_parse(caddr, &request->ep);
+        if (!end || *end) request->ep = HASH_EMPTY;
+        request->lane = lane;
+        request->queued = get_now();
+        request->deadline = request->queued + to_nsec(deadline);
+        request->seq = seq++;
+        if (id) request->id = strdup(id);
+        request_promote(request);
+        if (client_blocked(client) || !request_coalesce(request))
+                request_push(request);
+}
+
+/* Adds the new addresses in a space-separated list to the frontier */
+static void crawl_discover(const char *list)
+{
+        endpoint_t ep;
+        const char *next;
 
-        gnutella_conn_new(queue_pop(queue));
+        while (*list) {
+                if (*list == ' ') {
+                        list++;
+                        continue;
+                }
+                next = endpoint_parse(list, &ep);
+                if (next && (*next == ' ' || !*next)) {
+                        if (hash_set_add(visited, ep))
+                                frontier_push(frontier, ep);
+                        list = next;
+                } else
+                        while (*list && *list != ' ') list++;
+        }
+}
+
+static void crawl_feed(void)
+{
+        char addr[ENDPOINT_STRLEN];
+        endpoint_t ep;
+
+        while (num_queued + heap_len(deferred) < (unsigned) max_connections
+               && frontier_pop(frontier, &ep))
+                gnutella_conn_queue(stdio_client, endpoint_format(ep, addr),
+                                    LANE_WALK, 0, NULL);
+}
+
+static void crawl_init(void)
+{
+        FILE *f = fopen(crawl_seeds, "r");
+        char *line = NULL;
+        size_t len = 0;
 
+        if (!f) {
+                perror(crawl_seeds);
+                exit(1);
+        }
+
+        visited = hash_set_new();
+        frontier = frontier_new(crawl_budget);
+        while (0 < getline(&line, &len, f)) {
+                line[strcspn(line, "\r\n")] = 0;
+                crawl_discover(line);
+        }
+        free(line);
+        fclose(f);
+
+        /* Nothing else will wake the main loop to start these */
+        crawl_feed();
         maybe_dequeue();
 }
 
-void gnutella_conn_queue(const char *caddr)
+/* Answers a request that won't be carried out.  Without an address,
+ * the client is going away and nothing is reported. */
+static bool cancel_request(struct request *request, struct client *client,
+                           const char *addr)
+{
+        if (request->client != client) return False;
+        if (addr && 0 != strcmp(request->addr, addr)) return False;
+        if (addr) report_error(client, request->addr, FAIL_CANCELLED,
+                               "Cancelled");
+        request_unindex(request);
+        client->num_requests--;
+        free(request->addr);
+        free(request->id);
+        free(request);
+        return True;
+}
+
+/* Cancels the client's requests in a heap, and returns how many */
+static unsigned cancel_requests(struct heap *requests, struct client *client,
+                                const char *addr)
 {
-        char *addr = strdup(caddr);
-        queue_push(queue, addr);
+        unsigned j = 0, n = 0;
+
+        while (j < heap_len(requests)) {
+                struct request *request = heap_item(requests, j++);
+                if (request->client != client) continue;
+                if (addr && 0 != strcmp(request->addr, addr)) continue;
+                heap_remove(requests, request);
+                cancel_request(request, client, addr);
+                n++;
+                j = 0; /* Removal shuffles the heap */
+        }
+        return n;
+}
+
+/* Drop every queued request and open connection for addr from the
+ * client, or all of them if addr is NULL */
+static void gnutella_cancel(struct client *client, const char *addr)
+{
+        struct gnutella_conn *conn, *next;
+        unsigned j = 0;
+
+        for (int i = 0; i < NUM_LANES; i++) {
+                unsigned n = cancel_requests(client->requests[i], client,
+                                             addr);
+                lanes[i].len -= n;
+                num_queued -= n;
+        }
+        cancel_requests(deferred, client, addr);
+
+        for (conn = addr ? conn_find(addr) : conns; conn; conn = next) {
+                next = addr ? NULL : conn->next;
+                j = 0;
+                for (unsigned i = 0; i < conn->num_waiters; i++) {
+                        if (conn->waiters[i].client != client) {
+                                conn->waiters[j++] = conn->waiters[i];
+                                continue;
+                        }
+                        if (addr) report_error(client, addr, FAIL_CANCELLED,
+                                               "Cancelled");
+                        client->num_conns--;
+                        free(conn->waiters[i].id);
+                }
+                conn->num_waiters = j;
+                /* A probe nobody is waiting for still finishes when the
+                 * client has gone, for the trace and the crawl */
+                if (addr && !j) gnutella_delete(conn);
+        }
 }
 
-void gnutella_conn_new(char *addr)
+/* Starts a probe for the request, taking its address */
+static struct gnutella_conn *conn_alloc(struct request *request,
+                                        endpoint_t ep)
 {
         struct gnutella_conn *conn;
+
+        myalloc(conn);
+        conn->next = conns;
+        if (conns) conns->prev = conn;
+        conns = conn;
+        num_conns++;
+        conn->max_waiters = 1;
+        myallocn(conn->waiters, conn->max_waiters);
+        conn_attach(conn, request);
+
+        conn->addr = request->addr;
+        conn->ep = ep;
+        hash_put(in_flight, ep, conn);
+        conn->start = get_now();
+        conn->peer_type = "Peer";
+        return conn;
+}
+
+/* Returns 0 on success, or -1 and sets errno */
+static int bind_source(int fd)
+{
+        static unsigned next_source = 0;
+        struct source *source;
+        struct sockaddr_in sin;
+        int one = 1;
+
+        if (!num_sources) return 0;
+        source = &sources[next_source++ % num_sources];
+
+        memset(&sin, 0, sizeof sin);
+        sin.sin_family = AF_INET;
+        sin.sin_addr = source->addr;
+
+        if (!source->lo) {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+                if (0 > setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+                                   &one, sizeof one)) die();
+#endif
+                return bind(fd, (struct sockaddr *) &sin, sizeof sin);
+        }
+
+        if (0 > setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one))
+                die();
+        for (int i = 0; i < BIND_TRIES; i++) {
+                sin.sin_port = htons(source->next);
+                if (++source->next > source->hi) source->next = source->lo;
+                if (0 == bind(fd, (struct sockaddr *) &sin, sizeof sin))
+                        return 0;
+                if (errno != EADDRINUSE) break;
+        }
+        return -1;
+}
+
+/* A probe couldn't start for want of local resources.  Puts the
+ * request off for a doubling, jittered delay, or reports the failure
+ * once it has been put off local_retries times.  Returns True if it
+ * was put off.
+ */
+static bool request_retry(struct request *request, const char *what,
+                          int err)
+{
+        nsec_t now = get_now();
+        float delay;
+
+        if (request->retries >= local_retries) {
+                report_error(request->client, request->addr, FAIL_LOCAL,
+                             "%s: %s", what, strerror(err));
+                return False;
+        }
+        delay = RETRY_DELAY * (1 << min(request->retries, 10))
+                * (0.5 + real_random());
+        request->retries++;
+        request->client->num_requests++;
+        request->ready = now + to_nsec(delay);
+        request->reserved = True;
+        heap_insert(deferred, request);
+        rate_wakeup_in(delay, now);
+        retried++;
+        return True;
+}
+
+/* Starts a probe for the request.  Returns False if the request was
+ * put off to try again, and is still queued. */
+static bool gnutella_conn_new(struct request *request)
+{
+        struct client *client = request->client;
+        char *addr = request->addr;
+        struct gnutella_conn *conn;
         struct sockaddr_in sin;
         int fd = -1;
-        unsigned i;
-        char ip[16];
-        unsigned long int port;
-        char *endptr;
+        endpoint_t ep;
+        const char *end;
+        const char *what;
         int err;
         int value;
 
-        for (i = 0; addr[i] != ':'; i++) {
-                if (!addr[i]) goto bad_address;
-                if (i > (sizeof ip) - 1) goto bad_address;
-                ip[i] = addr[i];
+        end = endpoint_parse(addr, &ep);
+        if (!end || *end) {
+                report_error(client, addr, FAIL_INVALID, "Bad address");
+                free(addr);
+                return True;
         }
-        ip[i++] = 0;
-                
-        if (0 > inet_aton(ip, &sin.sin_addr)) goto bad_address;
-        port = strtoul(&addr[i], &endptr, 10);
-        if (!addr[i] || *endptr) goto bad_address;
-        if (port > 65535) goto bad_address;
-        sin.sin_port = htons(port);
+        memset(&sin, 0, sizeof sin);
+        sin.sin_addr.s_addr = htonl(endpoint_ip(ep));
+        sin.sin_port = htons(endpoint_port(ep));
         sin.sin_family = AF_INET;
 
         /* Setup connection */
         fd = socket(PF_INET, SOCK_STREAM, 0);
-        if (0 > fd) die();
+        if (0 > fd) {
+                if (errno_failure(errno) != FAIL_LOCAL) die();
+                what = "Socket error";
+                goto local;
+        }
 
         value = fcntl(fd, F_GETFL, O_NONBLOCK);
         if (value == -1) die();
         if (fcntl(fd, F_SETFL, value | O_NONBLOCK) < 0) die();
 
+        if (0 > bind_source(fd)) {
+                what = "Bind error";
+                goto local;
+        }
+
+#ifdef TCP_FASTOPEN_CONNECT
+        value = 1;
+        if (fast_open && 0 > setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                                        &value, sizeof value))
+                die();
+#endif
+
         err = connect(fd, (struct sockaddr *) &sin, sizeof sin);
-        if (0 > err) {
-                if (errno == EINPROGRESS) { /* This is OK */ } 
-                else if (errno == EAGAIN) {
-                bad_address:
-                        report_error(addr, "Bind error");
-                        goto error;
-                }
-                else {
-                        report_error(addr, "Failed: %s", strerror(errno));
-                error:
-                        if (fd >= 0) close(fd);
-                        return;
+        if (0 > err && errno != EINPROGRESS) {
+                enum failure failure = errno_failure(errno);
+                char msg[128];
+
+                if (failure == FAIL_LOCAL) {
+                        what = errno == EAGAIN ? "Out of local ports"
+                                : "Failed";
+                        goto local;
                 }
+                snprintf(msg, sizeof msg, "Failed: %s", strerror(errno));
+                report_error(client, addr, failure, "%s", msg);
+                if (trace_out) trace_failure(ep, 0, failure, msg);
+                close(fd);
+                free(addr);
+                return True;
         }
 
-        myalloc(conn);
-
-        conn->addr = addr;
+        conn = conn_alloc(request, ep);
         conn->file = file_new(fd);
         conn->file->err_handler = gnutella_err_handler;
         conn->file->err_data = conn;
         conn->read_line = read_line_new(conn->file, gnutella_line_handler1,
                                         conn);
-        conn->timer = timer_new(timeout, gnutella_timeout, conn);
-        conn->peer_type = "Peer";
+        conn->file->drain_handler = gnutella_drain_handler;
+        conn->file->drain_data = conn;
+        conn->timer = timer_new(timeouts[PHASE_CONNECT], gnutella_timeout,
+                                conn);
+        conn->phase = PHASE_CONNECT;
+        conn->phase_start = get_now();
+        conn->fast_open = fast_open;
 
         file_printf(conn->file, "GNUTELLA CONNECT/0.6\r\n" 
                    "User-Agent: Cruiser (http://mirage.cs.uoregon.edu/P2P/root-tools.html)\r\n" 
                    "X-Ultrapeer: False\r\n"     
                    "Crawler: 0.1\r\n"           
                    "\r\n");                   
+
+        /* The first write sends the SYN, so it can't wait for POLLOUT */
+        if (fast_open && !file_flush(conn->file))
+                conn_fail(conn, errno_failure(errno), "Failed: %s",
+                          strerror(errno));
+        return True;
+
+local:
+        err = errno;
+        if (fd >= 0) close(fd);
+        if (request_retry(request, what, err)) return False;
+        free(addr);
+        return True;
+}
+
+static void parse_filter(char *arg)
+{
+        char *word;
+
+        filter_classes = 0;
+        filter_self = filter_malformed = False;
+        for (word = strtok(arg, ", "); word; word = strtok(NULL, ", ")) {
+                if (0 == strcmp(word, "private"))
+                        filter_classes |= ENDPOINT_PRIVATE;
+                else if (0 == strcmp(word, "bogon"))
+                        filter_classes |= ENDPOINT_BOGON;
+                else if (0 == strcmp(word, "self"))
+                        filter_self = True;
+                else if (0 == strcmp(word, "malformed"))
+                        filter_malformed = True;
+                else if (0 != strcmp(word, "none")) {
+                        fprintf(stderr, "Bad filter: %s\n", word);
+                        exit(1);
+                }
+        }
+}
+
+static void parse_fields(char *arg)
+{
+        char *word;
+
+        fields = 0;
+        for (word = strtok(arg, ", "); word; word = strtok(NULL, ", ")) {
+                if (0 == strcmp(word, "peers")) fields |= FIELD_PEERS;
+                else if (0 == strcmp(word, "leaves")) fields |= FIELD_LEAVES;
+                else if (0 == strcmp(word, "agent")) fields |= FIELD_AGENT;
+                else {
+                        fprintf(stderr, "Bad field: %s\n", word);
+                        exit(1);
+                }
+        }
+}
+
+/* RATE[,BURST].  The burst defaults to a second's worth of tokens. */
+static void parse_rate(const char *arg, double *rate, double *burst)
+{
+        int n = sscanf(arg, "%lf,%lf", rate, burst);
+
+        if (n < 1 || *rate < 0 || (n == 2 && *burst < 1)) {
+                fprintf(stderr, "Bad rate: %s\n", arg);
+                exit(1);
+        }
+        if (n == 1) *burst = max(1, *rate);
+}
+
+static void parse_source(const char *arg)
+{
+        char ip[16];
+        struct source *source;
+        unsigned lo = 0, hi = 0;
+        int n = sscanf(arg, " %15[0-9.]:%u-%u", ip, &lo, &hi);
+
+        if (n != 1 && n != 3) goto bad;
+        if (n == 3 && (!lo || lo > hi || hi > 65535)) goto bad;
+
+        myrealloc(sources, num_sources + 1);
+        source = &sources[num_sources++];
+        if (!inet_aton(ip, &source->addr)) goto bad;
+        source->lo = source->next = lo;
+        source->hi = hi;
+        return;
+
+bad:
+        fprintf(stderr, "Bad source address: %s\n", arg);
+        exit(1);
 }
 
 static void gnutella_timeout(void *vconn)
 {
         struct gnutella_conn *conn = vconn;
-        report_error(conn->addr, "Timeout");
-        gnutella_delete(conn);
+
+        if (early_complete && conn->phase == PHASE_HEADER
+            && conn->peer_type[0] != 'P' && (conn->seen & fields)) {
+                partial_count++;
+                gnutella_line_handler_done(conn);
+                return;
+        }
+        conn_fail(conn, FAIL_TIMEOUT, "Timeout");
+}
+
+static void phase_sample(enum phase phase, float elapsed)
+{
+        struct quantile *q = phase_times[phase];
+        float t;
+
+        quantile_add(q, elapsed);
+        if (!timeout_factor || quantile_count(q) < TIMEOUT_MIN_SAMPLES)
+                return;
+
+        t = timeout_factor * quantile_get(q, TIMEOUT_QUANTILE);
+        timeouts[phase] = max(min_timeout, min(timeout, t));
 }
 
-void gnutella_update_timer(struct gnutella_conn *conn)
+/* The current phase completed successfully; start the next one */
+void gnutella_update_timer(struct gnutella_conn *conn, enum phase next)
 {
-        timer_reset(conn->timer, timeout);
+        nsec_t now = get_now();
+        phase_sample(conn->phase, to_sec(now - conn->phase_start));
+        conn->phase = next;
+        conn->phase_start = now;
+        timer_reset(conn->timer, timeouts[next]);
+}
+
+/* The request has been written, so the connection must be up.  With
+ * fast open, the request may have been written before the handshake,
+ * so the connection time counts toward the wait for the first byte. */
+static void gnutella_drain_handler(void *vconn)
+{
+        struct gnutella_conn *conn = vconn;
+        if (conn->phase != PHASE_CONNECT) return;
+        conn->connected = get_now();
+        if (conn->fast_open) {
+                conn->phase = PHASE_FIRST_BYTE;
+                timer_reset(conn->timer, timeouts[PHASE_CONNECT]
+                            + timeouts[PHASE_FIRST_BYTE]);
+                return;
+        }
+        gnutella_update_timer(conn, PHASE_FIRST_BYTE);
 }
 
 void gnutella_line_handler1(void *vconn, char *line)
@@ -600,22 +1824,23 @@ void gnutella_line_handler1(void *vconn, char *line)
         struct gnutella_conn *conn = vconn;
         int code;
         
-        if (0 != strncmp(line, "GNUTELLA/0.6 ", 13)) {
-        bad_handshake:
-                report_error(conn->addr, "Bad Handshake %s", line);
-                gnutella_delete(conn);
+        /* Only a well-formed status line that turns us away is a
+         * refusal; anything else isn't speaking the protocol */
+        if (0 != strncmp(line, "GNUTELLA/0.6 ", 13)
+            || 3 != strspn(line + 13, "0123456789")
+            || (line[16] && line[16] != ' ')) {
+                conn_fail(conn, FAIL_PROTOCOL, "Bad Handshake %s", line);
+                return;
+        }
+        code = atoi(line + 13);
+        if (code != 200 && code != 503 && code != 593) {
+                conn_fail(conn, FAIL_REFUSED, "Bad Handshake %s", line);
                 return;
         }
-
-        line += 13;
-
-        code = atoi (line);
-        if (code != 200 && code != 503 && code != 593)
-                goto bad_handshake;
 
         conn->read_line->line_handler = gnutella_line_handler2;
 
-        gnutella_update_timer(conn);
+        gnutella_update_timer(conn, PHASE_HEADER);
 }
 
 void string_extend(char **ps, const char *s2)
@@ -629,11 +1854,13 @@ void string_extend(char **ps, const char *s2)
         }
 }
 
-static void report_neighbors(const char *addr, const char *user_agent,
-                             const char *peer_type,
+static void report_neighbors(struct client *client, const char *addr,
+                             const char *user_agent, const char *peer_type,
                              const char *neighbors, const char *leafs)
 {
-        file_printf(file_stdout, "R: %s(|%s|): %s %s, %s\n",
+        if (!client) return;
+        result_printed(client);
+        file_printf(client->out, "R: %s(|%s|): %s %s, %s\n",
                     addr, user_agent, peer_type, neighbors, leafs);
 }
 
@@ -645,8 +1872,16 @@ static void gnutella_line_handler_done(struct gnutella_conn *conn)
         if (!conn->neighbors) conn->neighbors = nothing;
         if (!conn->leafs) conn->leafs = nothing;
 
-        report_neighbors(conn->addr, conn->user_agent, conn->peer_type,
-                         conn->neighbors, conn->leafs);
+        for (unsigned i = 0; i < conn->num_waiters; i++) {
+                report_profile(conn, &conn->waiters[i]);
+                report_neighbors(conn->waiters[i].client, conn->addr,
+                                 conn->user_agent, conn->peer_type,
+                                 conn->neighbors, conn->leafs);
+        }
+        if (trace_out)
+                trace_result(conn->ep, get_now() - conn->start, NULL, conn);
+        if (topo_out) topo_result(conn);
+        if (visited) crawl_discover(conn->neighbors);
 
         if (conn->user_agent == &nothing[0]) conn->user_agent = NULL;
         if (conn->neighbors == &nothing[0]) conn->neighbors = NULL;
@@ -655,10 +1890,230 @@ static void gnutella_line_handler_done(struct gnutella_conn *conn)
         gnutella_delete(conn);
 }
 
+static void replay_done(void *vconn)
+{
+        struct gnutella_conn *conn = vconn;
+        struct replay_result *result = conn->replay;
+
+        if (!result->peer_type) {
+                enum failure failure;
+                const char *msg = failure_parse(result->text, &failure);
+                conn_fail(conn, failure, "%s", msg);
+                return;
+        }
+
+        for (unsigned i = 0; i < conn->num_waiters; i++) {
+                report_profile(conn, &conn->waiters[i]);
+                report_neighbors(conn->waiters[i].client, conn->addr,
+                                 fields & FIELD_AGENT ? result->text : "",
+                                 result->peer_type,
+                                 fields & FIELD_PEERS ? result->peers : "",
+                                 fields & FIELD_LEAVES ? result->leaves : "");
+        }
+        gnutella_delete(conn);
+}
+
+/* Like gnutella_conn_new(), but the result comes from the trace */
+static void replay_conn_new(struct request *request)
+{
+        struct client *client = request->client;
+        char *addr = request->addr;
+        struct gnutella_conn *conn;
+        struct replay_addr *ra = NULL;
+        endpoint_t ep;
+        const char *end = endpoint_parse(addr, &ep);
+
+        if (end && !*end) ra = hash_get(replay_addrs, ep);
+        if (!ra) {
+                report_error(client, addr, FAIL_INVALID, "Not in trace");
+                free(addr);
+                return;
+        }
+
+        conn = conn_alloc(request, ep);
+        conn->connected = conn->start;
+        conn->replay = ra->next_up;
+        ra->next_up = ra->next_up->next ? ra->next_up->next : ra->first;
+        conn->timer = timer_new(to_sec(conn->replay->duration) * replay_scale,
+                                replay_done, conn);
+}
+
+/* Joins a list of endpoints with spaces */
+static char *format_endpoints(const endpoint_t *eps, unsigned n)
+{
+        char *s, *p;
+
+        myallocn(s, n * ENDPOINT_STRLEN + 1);
+        p = s;
+        for (unsigned i = 0; i < n; i++) {
+                if (i) *p++ = ' ';
+                endpoint_format(eps[i], p);
+                p += strlen(p);
+        }
+        return s;
+}
+
+static void replay_add(endpoint_t ep, struct replay_result *result)
+{
+        struct replay_addr *ra = hash_get(replay_addrs, ep);
+        struct replay_result **p;
+
+        if (!ra) {
+                myalloc(ra);
+                hash_put(replay_addrs, ep, ra);
+        }
+        for (p = &ra->first; *p; p = &(*p)->next);
+        *p = result;
+        if (!ra->next_up) ra->next_up = result;
+}
+
+static void replay_load(const char *path)
+{
+        struct trace *trace = trace_open(path);
+        struct trace_record r;
+
+        if (!trace) {
+                perror(path);
+                exit(1);
+        }
+
+        replay_addrs = hash_new();
+        while (trace_read(trace, &r)) {
+                struct replay_result *result;
+
+                if (r.kind == TRACE_REQUEST) continue;
+
+                myalloc(result);
+                result->peer_type = r.kind == TRACE_FAILURE ? NULL
+                        : r.kind == TRACE_ULTRAPEER ? "Ultrapeer"
+                        : r.kind == TRACE_LEAF ? "Leaf" : "Peer";
+                result->text = strdup(r.text ? r.text : "");
+                result->peers = format_endpoints(r.peers, r.num_peers);
+                result->leaves = format_endpoints(r.leaves, r.num_leaves);
+                result->duration = r.duration;
+                replay_add(r.ep, result);
+        }
+        trace_close(trace);
+}
+
+#define SYNTH_NET 0xc6120000    /* 198.18.0.0/15, set aside for benchmarks */
+#define SYNTH_MAX (1 << 17)
+#define SYNTH_PORT 6346
+
+/* Builds a random topology of ultrapeers at 198.18.0.0 and up, and
+ * answers requests from it the way replay does.  Degrees are Pareto
+ * (P(D > x) = (3/x)^1.5, at most 100), about as skewed as real
+ * Gnutella, and the edges are a configuration model without loops or
+ * repeats. */
+static void synth_load(unsigned nodes, unsigned seed)
+{
+        unsigned *degree, *stubs, **adj, num_stubs = 0;
+        endpoint_t *eps;
+
+        rng_seed(seed);
+        myallocn(degree, nodes);
+        myallocn(adj, nodes);
+        for (unsigned i = 0; i < nodes; i++) {
+                double u = 1 - real_random();
+                degree[i] = min(100, (unsigned) (3 / pow(u, 1 / 1.5)));
+                num_stubs += degree[i];
+                myallocn(adj[i], degree[i]);
+        }
+
+        myallocn(stubs, num_stubs);
+        num_stubs = 0;
+        for (unsigned i = 0; i < nodes; i++) {
+                for (unsigned j = 0; j < degree[i]; j++)
+                        stubs[num_stubs++] = i;
+                degree[i] = 0;
+        }
+        for (unsigned i = num_stubs - 1; i > 0; i--) {
+                unsigned j = rng_below(i + 1), t = stubs[i];
+                stubs[i] = stubs[j];
+                stubs[j] = t;
+        }
+        for (unsigned i = 0; i + 1 < num_stubs; i += 2) {
+                unsigned a = stubs[i], b = stubs[i+1], j;
+                if (a == b) continue;
+                for (j = 0; j < degree[a] && adj[a][j] != b; j++);
+                if (j < degree[a]) continue;
+                adj[a][degree[a]++] = b;
+                adj[b][degree[b]++] = a;
+        }
+
+        replay_addrs = hash_new();
+        myallocn(eps, 100);
+        for (unsigned i = 0; i < nodes; i++) {
+                struct replay_result *result;
+
+                for (unsigned j = 0; j < degree[i]; j++)
+                        eps[j] = endpoint_make(SYNTH_NET + adj[i][j],
+                                               SYNTH_PORT);
+                myalloc(result);
+                result->peer_type = "Ultrapeer";
+                result->text = strdup("Synthetic");
+                result->peers = format_endpoints(eps, degree[i]);
+                result->leaves = strdup("");
+                replay_add(endpoint_make(SYNTH_NET + i, SYNTH_PORT), result);
+                free(adj[i]);
+        }
+        free(eps);
+        free(stubs);
+        free(adj);
+        free(degree);
+}
+
+static void parse_synth(const char *arg)
+{
+        unsigned nodes, seed = 1;
+
+        if (sscanf(arg, "%u,%u", &nodes, &seed) < 1
+            || nodes < 2 || nodes > SYNTH_MAX) {
+                fprintf(stderr, "Bad topology: %s\n", arg);
+                exit(1);
+        }
+        synth_load(nodes, seed);
+}
+
+/* Rewrites a comma-separated list of endpoints in place as a
+ * space-separated list of the ones worth keeping */
+static void filter_endpoints(char *list, endpoint_t self)
+{
+        char *r = list, *w = list, *start, *end;
+        const char *parsed;
+        endpoint_t ep;
+
+        while (*r) {
+                while (*r == ',' || *r == ' ' || *r == '\t') r++;
+                if (!*r) break;
+                start = r;
+                while (*r && *r != ',') r++;
+                end = r;
+                while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+                        end--;
+
+                filter_seen++;
+                parsed = endpoint_parse(start, &ep);
+                if (parsed != end) {
+                        if (filter_malformed) goto drop;
+                } else if ((endpoint_class(ep) & filter_classes)
+                           || (filter_self && ep == self))
+                        goto drop;
+
+                if (w != list) *w++ = ' ';
+                memmove(w, start, end - start);
+                w += end - start;
+                continue;
+        drop:
+                filter_dropped++;
+        }
+        *w = 0;
+}
+
 void gnutella_line_handler2(void *vconn, char *line)
 {
         struct gnutella_conn *conn = vconn;
-        char *colon, *label, *value, *s;
+        char *colon, *label, *value;
 
         if (!*line) {
                 gnutella_line_handler_done(conn);
@@ -667,8 +2122,7 @@ void gnutella_line_handler2(void *vconn, char *line)
         
         colon = strchr(line, ':');
         if (!colon) {
-                report_error(conn->addr, "Bad Headers: %s", line);
-                gnutella_delete(conn);
+                conn_fail(conn, FAIL_PROTOCOL, "Bad Headers: %s", line);
                 return;
         }
 
@@ -679,8 +2133,7 @@ void gnutella_line_handler2(void *vconn, char *line)
 
         if (0 == strcmp("X-Ultrapeer", label)) {
                 if (0 != strcmp(conn->peer_type, "Peer")) {
-                        report_error(conn->addr, "Multiple X-Ultrapeer");
-                        gnutella_delete(conn);
+                        conn_fail(conn, FAIL_PROTOCOL, "Multiple X-Ultrapeer");
                         return;
                 }
                 
@@ -689,56 +2142,499 @@ void gnutella_line_handler2(void *vconn, char *line)
                 } else if (0 == strcasecmp("false", value)) {
                         conn->peer_type = "Leaf";
                 } else {
-                        report_error(conn->addr, "Bad X-Ultrapeer: %s", value);
-                        gnutella_delete(conn);
+                        conn_fail(conn, FAIL_PROTOCOL, "Bad X-Ultrapeer: %s",
+                                  value);
                         return;
                 }
         } else if (0 == strcmp("Peers", label)) {
-                for (s = value; *s; s++) if (*s == ',') *s = ' ';
-                string_extend(&conn->neighbors, value);
+                if (fields & FIELD_PEERS) {
+                        filter_endpoints(value, conn->ep);
+                        string_extend(&conn->neighbors, value);
+                        conn->seen |= FIELD_PEERS;
+                }
         } else if (0 == strcmp("Leaves", label)) {
-                for (s = value; *s; s++) if (*s == ',') *s = ' ';
-                string_extend(&conn->leafs, value);
+                if (fields & FIELD_LEAVES) {
+                        filter_endpoints(value, conn->ep);
+                        string_extend(&conn->leafs, value);
+                        conn->seen |= FIELD_LEAVES;
+                }
         } else if (0 == strcmp("User-Agent", label)) {
-                string_extend(&conn->user_agent, value);
+                if (fields & FIELD_AGENT) {
+                        string_extend(&conn->user_agent, value);
+                        conn->seen |= FIELD_AGENT;
+                }
         }
 
-        gnutella_update_timer(conn);
+        gnutella_update_timer(conn, PHASE_HEADER);
+        if (early_complete && conn->peer_type[0] != 'P'
+            && conn->seen == fields) {
+                early_count++;
+                gnutella_line_handler_done(conn);
+        }
 }
 
-static void stdin_line_handler(void *v __unused, char *line)
+/* Requests have the form: address [lane [deadline]]
+ *
+ * The lane is "walk", "spec", or "bootstrap" (default "walk").  The
+ * deadline is in seconds from now (default 0), and may be negative.
+ * Within a lane, requests are handled earliest deadline first.  An
+ * address asked for again in a higher lane moves the earlier request
+ * up with it, and both are answered.
+ *
+ * A line of the form "C: address" cancels an earlier request.
+ */
+static void client_line_handler(void *vclient, char *line)
 {
-        gnutella_conn_queue(line);
+        struct client *client = vclient;
+        char *addr, *word;
+        enum lane lane = LANE_WALK;
+        float deadline = 0;
+        const char *id = NULL;
+
+        if (0 == strncmp(line, "C: ", 3)) {
+                line += 3;
+                gnutella_cancel(client, get_word(&line));
+                return;
+        }
+
+        if (0 == strncmp(line, "G: ", 3)) {
+                client->use_credits = True;
+                client->credits += atol(&line[3]);
+                return;
+        }
+
+        addr = get_word(&line);
+        if (!*addr) return;
+
+        word = get_word(&line);
+        if (*word) {
+                for (lane = 0; lane < NUM_LANES; lane++)
+                        if (0 == strcmp(word, lane_names[lane])) break;
+                if (lane == NUM_LANES) {
+                        report_error(client, addr, FAIL_INVALID,
+                                     "Bad lane %s", word);
+                        return;
+                }
+                word = get_word(&line);
+                if (*word) deadline = atof(word);
+                word = get_word(&line);
+                if (*word) id = word;
+        }
+
+        if (trace_out) {
+                struct trace_record r;
+                memset(&r, 0, sizeof r);
+                r.kind = TRACE_REQUEST;
+                r.time = get_now();
+                r.lane = lane;
+                if (endpoint_parse(addr, &r.ep)) trace_write(trace_out, &r);
+        }
+
+        gnutella_conn_queue(client, addr, lane, deadline, id);
+}
+
+static struct client *client_new(struct file *in, struct file *out)
+{
+        struct client *client;
+
+        myalloc(client);
+        client->next = clients;
+        if (clients) clients->prev = client;
+        clients = client;
+
+        client->in = in;
+        client->out = out;
+        if (in) client->read_line = read_line_new(in, client_line_handler,
+                                                  client);
+        for (int i = 0; i < NUM_LANES; i++)
+                client->requests[i] = heap_new(request_cmp,
+                                               offsetof(struct request,
+                                                        heap_loc));
+        client->latest = hash_new();
+        return client;
+}
+
+/* The client's file has failed or hit the end, and is about to be
+ * deleted by file_handler() */
+static void client_err_handler(void *vclient)
+{
+        struct client *client = vclient;
+
+        read_line_delete(client->read_line);
+        client->read_line = NULL;
+        client->in = NULL;
+        if (client == stdio_client) {
+                /* Results for earlier requests still go out */
+                file_stdin = NULL;
+                return;
+        }
+
+        if (client->prev) client->prev->next = client->next;
+        else clients = client->next;
+        if (client->next) client->next->prev = client->prev;
+        gnutella_cancel(client, NULL);
+        for (int i = 0; i < NUM_LANES; i++)
+                heap_delete(client->requests[i]);
+        hash_delete(client->latest);
+        free(client);
+}
+
+static void accept_handler(void *vfd)
+{
+        int fd, lfd = (pint) vfd;
+        struct client *client;
+        struct file *file;
+
+        while (0 <= (fd = accept(lfd, NULL, NULL))) {
+                file = file_new(fd);
+                client = client_new(file, file);
+                file->err_handler = client_err_handler;
+                file->err_data = client;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+            && errno != ECONNABORTED)
+                perror("accept");
+}
+
+/* Listens on a Unix socket if the address has a slash in it, and on
+ * TCP otherwise: [IP:]PORT, on all interfaces by default. */
+static void listen_init(const char *addr)
+{
+        struct event_handler *event_handler;
+        int fd, one = 1;
+
+        if (strchr(addr, '/')) {
+                struct sockaddr_un sun;
+
+                memset(&sun, 0, sizeof sun);
+                sun.sun_family = AF_UNIX;
+                if (strlen(addr) >= sizeof sun.sun_path) goto bad_address;
+                strcpy(sun.sun_path, addr);
+                unlink(addr);
+                if (0 > (fd = socket(PF_UNIX, SOCK_STREAM, 0))) die();
+                if (0 > bind(fd, (struct sockaddr *) &sun, sizeof sun))
+                        goto error;
+        } else {
+                struct sockaddr_in sin;
+                /* Anyone who can connect can have us probe any address,
+                 * so other interfaces must be asked for by name */
+                char ip[16] = "127.0.0.1";
+                unsigned port;
+                int n = 0;
+
+                if ((1 != sscanf(addr, "%u%n", &port, &n) || addr[n])
+                    && (2 != sscanf(addr, "%15[0-9.]:%u%n", ip, &port, &n)
+                        || addr[n]))
+                        goto bad_address;
+                memset(&sin, 0, sizeof sin);
+                sin.sin_family = AF_INET;
+                sin.sin_port = htons(port);
+                if (port > 65535 || !inet_aton(ip, &sin.sin_addr))
+                        goto bad_address;
+                if (0 > (fd = socket(PF_INET, SOCK_STREAM, 0))) die();
+                if (0 > setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                                   &one, sizeof one)) die();
+                if (0 > bind(fd, (struct sockaddr *) &sin, sizeof sin))
+                        goto error;
+        }
+        if (0 > listen(fd, 64)) goto error;
+        if (0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) die();
+
+        event_handler = event_handler_new(fd);
+        event_handler->func = accept_handler;
+        event_handler->data = (void *) (pint) fd;
+        return;
+
+error:
+        perror(addr);
+        exit(1);
+bad_address:
+        fprintf(stderr, "Bad listening address: %s\n", addr);
+        exit(1);
 }
 
-void stdin_err_handler(void *vfile __unused)
+static void flow_control(void)
 {
+        for (struct client *client = clients; client; client = client->next) {
+                if (!client->out_paused && client->out->wlen > out_high)
+                        client->out_paused = True;
+                else if (client->out_paused && client->out->wlen < out_low)
+                        client->out_paused = False;
+                else continue;
+
+                if (!client->in) continue;
+                if (client->out_paused)
+                        client->in->event_handler->pollfd->events &= ~POLLIN;
+                else
+                        client->in->event_handler->pollfd->events |= POLLIN;
+        }
 }
 
 void tick(void *vdata __unused)
 {
-        file_printf(file_stdout, "Q: %d %d\n", queue_len(queue), num_pollfds - 2);
+        for (struct client *client = clients; client; client = client->next)
+                file_printf(client->out, "Q: %u %u\n",
+                            client->num_requests, client->num_conns);
+        if (trace_out) trace_flush(trace_out);
+        if (topo_out) topo_flush(topo_out);
         timer_new(0.01, tick, NULL);
 }
 
-int main(void)
+static void stats_print(struct client *client)
+{
+        struct file *out = client->out;
+        unsigned outbuf = out->wlen;
+
+        file_printf(out, "S: timeouts");
+        for (int i = 0; i < NUM_PHASES; i++)
+                file_printf(out, " %s=%.3f", phase_names[i],
+                            timeouts[i]);
+        file_printf(out, " samples");
+        for (int i = 0; i < NUM_PHASES; i++)
+                file_printf(out, " %s=%lu", phase_names[i],
+                            quantile_count(phase_times[i]));
+        file_printf(out, " queued");
+        for (int i = 0; i < NUM_LANES; i++)
+                file_printf(out, " %s=%u", lane_names[i],
+                            lanes[i].len);
+        file_printf(out, " wait=%.3f/%.3f outbuf=%u%s",
+                    wait_count ? wait_total / wait_count : 0.0, wait_max,
+                    outbuf, client->out_paused ? " paused" : "");
+        if (global_rate || prefix_rate)
+                file_printf(out, " deferred=%u defer=%.3f/%.3f/%lu"
+                            " prefixes=%u", heap_len(deferred),
+                            defer_count ? defer_total / defer_count : 0.0,
+                            defer_max, defer_count,
+                            hash_len(prefix_buckets));
+        if (client->use_credits)
+                file_printf(out, " credits=%ld", client->credits);
+        file_printf(out, " filtered=%lu/%lu coalesced=%lu", filter_dropped,
+                    filter_seen, coalesced);
+        file_printf(out, " retried=%lu failed", retried);
+        for (int i = 0; i < NUM_FAILURES; i++)
+                file_printf(out, " %s=%lu", failure_names[i],
+                            failure_counts[i]);
+        if (early_complete)
+                file_printf(out, " early=%lu partial=%lu", early_count,
+                            partial_count);
+        if (visited)
+                file_printf(out, " visited=%u frontier=%llu"
+                            " spilled=%llu",
+                            hash_set_len(visited),
+                            (unsigned long long) frontier_len(frontier),
+                            (unsigned long long) frontier_spilled(frontier));
+        file_write(out, "\n", 1);
+}
+
+void stats(void *vdata __unused)
+{
+        for (struct client *client = clients; client; client = client->next)
+                stats_print(client);
+        filter_dropped = filter_seen = 0;
+        coalesced = 0;
+        early_count = partial_count = 0;
+        retried = 0;
+        memset(failure_counts, 0, sizeof failure_counts);
+        wait_total = wait_max = 0;
+        wait_count = 0;
+        defer_total = defer_max = 0;
+        defer_count = 0;
+        timer_new(stats_interval, stats, NULL);
+}
+
+static void usage(const char *argv0)
 {
-        struct read_line *stdin_read_line;
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "  -t SECONDS  Longest per-phase timeout (default %g)\n"
+                "  -m SECONDS  Shortest adaptive timeout (default %g)\n"
+                "  -f FACTOR   Timeout multiple of the observed p99, "
+                "0 to disable (default %g)\n"
+                "  -s SECONDS  Print statistics this often (default off)\n"
+                "  -c N        At most N simultaneous connections "
+                "(default %d)\n"
+                "  -w W,S,B    Relative shares of the walk, spec, and "
+                "bootstrap lanes\n"
+                "              (default %u,%u,%u)\n"
+                "  -o HIGH,LOW Pause when more than HIGH bytes of output "
+                "are unread,\n"
+                "              until fewer than LOW (default %u,%u)\n"
+                "  -g RATE[,BURST]  At most RATE connections per second "
+                "(default unlimited)\n"
+                "  -p RATE[,BURST]  At most RATE connections per second "
+                "to each /24\n"
+                "  -b IP[:LO-HI]  Connect from this local address and "
+                "port range\n"
+                "              (repeat for a pool of sources)\n"
+                "  -A          Reset connections instead of closing them, "
+                "to skip TIME_WAIT\n"
+                "  -r N        Retry a probe that fails for want of local "
+                "resources N times,\n"
+                "              after a growing delay (default %u)\n"
+#ifdef TCP_FASTOPEN_CONNECT
+                "  -F          Use TCP Fast Open\n"
+#endif
+#ifdef CLOCK_MONOTONIC_COARSE
+                "  -K          Use the coarse clock, if it is fine "
+                "enough for timeouts\n"
+#endif
+                "  -x CLASSES  Drop advertised neighbors of these kinds: "
+                "private, bogon,\n"
+                "              self, malformed, or none "
+                "(default private,bogon,self,malformed)\n"
+                "  -P FIELDS   Report only these parts of each result: "
+                "peers, leaves,\n"
+                "              agent (default all)\n"
+                "  -E          Finish a probe once those parts have arrived, "
+                "and report\n"
+                "              what has arrived if it times out\n"
+                "  -W FILE     Record requests and results in FILE\n"
+                "  -L FILE     Append the topology found to FILE, "
+                "for topo-compact\n"
+                "  -R FILE     Replay results from FILE instead of "
+                "contacting peers\n"
+                "  -T SCALE    Multiply replayed response times by SCALE "
+                "(default 1)\n"
+                "  -S N[,SEED] Answer from a random topology of N "
+                "ultrapeers at 198.18.0.0\n"
+                "              and up, instead of contacting peers\n"
+                "  -l ADDR     Take requests from drivers that connect to "
+                "ADDR, either\n"
+                "              [IP:]PORT (IP defaults to 127.0.0.1) or the "
+                "path of a Unix\n"
+                "              socket, instead of stdin\n"
+                "  -C FILE     Crawl every ultrapeer reachable from the "
+                "addresses in FILE,\n"
+                "              instead of reading requests (not with -l)\n"
+                "  -M MB       Keep at most MB of the crawl frontier in "
+                "memory (default %zu)\n"
+                ,
+                argv0, timeout, min_timeout, timeout_factor,
+                max_connections - 2,
+                lane_weights[LANE_WALK], lane_weights[LANE_SPECULATIVE],
+                lane_weights[LANE_BOOTSTRAP], out_high, out_low,
+                local_retries, crawl_budget >> 20);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct sigaction sa;
+        int c;
+
+        while ((c = getopt(argc, argv, "t:m:f:s:c:w:o:g:p:b:r:AEFKC:M:x:P:W:L:R:T:S:l:")) != -1) {
+                switch (c) {
+                case 't': timeout = atof(optarg); break;
+                case 'm': min_timeout = atof(optarg); break;
+                case 'f': timeout_factor = atof(optarg); break;
+                case 's': stats_interval = atof(optarg); break;
+                case 'c': max_connections = atoi(optarg) + 2; break;
+                case 'w':
+                        if (NUM_LANES != sscanf(optarg, "%u,%u,%u",
+                                                &lane_weights[0],
+                                                &lane_weights[1],
+                                                &lane_weights[2]))
+                                usage(argv[0]);
+                        break;
+                case 'o':
+                        if (2 != sscanf(optarg, "%u,%u", &out_high, &out_low)
+                            || out_low > out_high)
+                                usage(argv[0]);
+                        break;
+                case 'g': parse_rate(optarg, &global_rate, &global_burst);
+                        break;
+                case 'p': parse_rate(optarg, &prefix_rate, &prefix_burst);
+                        break;
+                case 'b': parse_source(optarg); break;
+                case 'A': abortive_close = True; break;
+                case 'r': local_retries = atoi(optarg); break;
+#ifdef TCP_FASTOPEN_CONNECT
+                case 'F': fast_open = True; break;
+#endif
+#ifdef CLOCK_MONOTONIC_COARSE
+                case 'K': coarse_clock = True; break;
+#endif
+                case 'x': parse_filter(optarg); break;
+                case 'P': parse_fields(optarg); break;
+                case 'E': early_complete = True; break;
+                case 'W':
+                        if (!(trace_out = trace_create(optarg))) {
+                                perror(optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'L':
+                        if (!(topo_out = topo_create(optarg))) {
+                                perror(optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'R': replay_load(optarg); replaying = True; break;
+                case 'T': replay_scale = atof(optarg); break;
+                case 'S': parse_synth(optarg); replaying = True; break;
+                case 'l': listen_addr = optarg; break;
+                case 'C': crawl_seeds = optarg; break;
+                case 'M': crawl_budget = atof(optarg) * (1 << 20); break;
+                default: usage(argv[0]);
+                }
+        }
+        if (timeout <= 0 || min_timeout <= 0 || timeout_factor < 0
+            || stats_interval < 0 || max_connections < 3 || replay_scale < 0
+            || (crawl_seeds && listen_addr))
+                usage(argv[0]);
+        for (int i = 0; i < NUM_LANES; i++)
+                if (!lane_weights[i]) usage(argv[0]);
+        min_timeout = min(min_timeout, timeout);
+
+        /* Each run draws its own retry jitter; -S has already built its
+         * topology from its own seed */
+        rng_seed(((uint64_t) getpid() << 32) ^ time(NULL));
+
         init();
         file_init();
 
-        //int fd = open("gnutella.in", O_RDONLY);
-        //if (0 > fd) die();
-        //struct file *file = file_new(fd);
-        //file_delete(file_stdin);
-        stdin_read_line = read_line_new(file_stdin, stdin_line_handler, NULL);
-        file_stdin->err_handler = stdin_err_handler;
-        timer_new(1, tick, NULL);
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = stop_handler;
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+
+        if (crawl_seeds || listen_addr) {
+                /* Nothing comes from stdin */
+                file_delete(file_stdin);
+                file_stdin = NULL;
+        }
+        if (!listen_addr) {
+                stdio_client = client_new(file_stdin, file_stdout);
+                if (file_stdin) {
+                        file_stdin->err_handler = client_err_handler;
+                        file_stdin->err_data = stdio_client;
+                }
+        }
+
+        if (crawl_seeds) {
+                fields |= FIELD_PEERS; /* Needed to find more peers */
+                crawl_init();
+        }
+        else {
+                if (listen_addr) listen_init(listen_addr);
+                timer_new(1, tick, NULL);
+                idle_timers++;
+        }
+        if (stats_interval) {
+                timer_new(stats_interval, stats, NULL);
+                idle_timers++;
+        }
         
         main_loop();
 
+        if (visited)
+                fprintf(stderr, "Crawled %u addresses\n",
+                        hash_set_len(visited));
+        if (trace_out) trace_close(trace_out);
+        if (topo_out) topo_close(topo_out);
         file_delete(file_stdout);
-        read_line_delete(stdin_read_line);
+        if (stdio_client && stdio_client->read_line)
+                read_line_delete(stdio_client->read_line);
         fclose(stderr);
         
         return 0;
@@ -0,0 +1,244 @@
+/*
+   hash.c: Hash table keyed by 64-bit integers
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "hash.h"
+
+struct slot
+{
+        uint64_t key;
+        void *value;
+};
+
+struct hash
+{
+        struct slot *slots;
+        unsigned mask;          //!< Number of slots, minus one
+        unsigned len;
+};
+
+struct hash_set
+{
+        uint64_t *keys;
+        unsigned mask;
+        unsigned len;
+};
+
+#define INITIAL_SIZE 64
+
+/* The finalizer from MurmurHash3.  Keys are often addresses that
+ * differ only in a few bits, so they need mixing. */
+static unsigned mix(uint64_t key)
+{
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+}
+
+static void init_slots(struct hash *hash, unsigned size)
+{
+        myallocn(hash->slots, size);
+        for (unsigned i = 0; i < size; i++)
+                hash->slots[i].key = HASH_EMPTY;
+        hash->mask = size - 1;
+}
+
+struct hash *hash_new(void)
+{
+        struct hash *hash;
+        myalloc(hash);
+        init_slots(hash, INITIAL_SIZE);
+        return hash;
+}
+
+unsigned hash_len(struct hash *hash)
+{
+        return hash->len;
+}
+
+static struct slot *find(struct hash *hash, uint64_t key)
+{
+        unsigned i = mix(key) & hash->mask;
+        while (hash->slots[i].key != key
+               && hash->slots[i].key != HASH_EMPTY)
+                i = (i + 1) & hash->mask;
+        return &hash->slots[i];
+}
+
+void *hash_get(struct hash *hash, uint64_t key)
+{
+        struct slot *slot = find(hash, key);
+        return slot->key == key ? slot->value : NULL;
+}
+
+/* Keep the table at most half full */
+static void resize(struct hash *hash)
+{
+        struct slot *old = hash->slots;
+        unsigned size = hash->mask + 1;
+
+        init_slots(hash, size << 1);
+        for (unsigned i = 0; i < size; i++) {
+                if (old[i].key == HASH_EMPTY) continue;
+                *find(hash, old[i].key) = old[i];
+        }
+        free(old);
+}
+
+void hash_put(struct hash *hash, uint64_t key, void *value)
+{
+        struct slot *slot;
+
+        if (key == HASH_EMPTY) die();
+
+        slot = find(hash, key);
+        if (slot->key == HASH_EMPTY) {
+                if (2 * (hash->len + 1) > hash->mask + 1) {
+                        resize(hash);
+                        slot = find(hash, key);
+                }
+                slot->key = key;
+                hash->len++;
+        }
+        slot->value = value;
+}
+
+void *hash_remove(struct hash *hash, uint64_t key)
+{
+        struct slot *slot = find(hash, key);
+        unsigned i, j;
+        void *value;
+
+        if (slot->key != key) return NULL;
+        value = slot->value;
+        hash->len--;
+
+        /* Shift later entries of the probe sequence back into the
+         * hole, rather than leaving a tombstone */
+        i = slot - hash->slots;
+        for (j = (i + 1) & hash->mask; hash->slots[j].key != HASH_EMPTY;
+             j = (j + 1) & hash->mask) {
+                unsigned home = mix(hash->slots[j].key) & hash->mask;
+                /* Leave it if its home is cyclically in (i, j] */
+                if (i <= j ? (i < home && home <= j)
+                           : (i < home || home <= j))
+                        continue;
+                hash->slots[i] = hash->slots[j];
+                i = j;
+        }
+        hash->slots[i].key = HASH_EMPTY;
+        return value;
+}
+
+bool hash_next(struct hash *hash, unsigned *pos, uint64_t *key,
+               void **value)
+{
+        for (; *pos <= hash->mask; (*pos)++) {
+                struct slot *slot = &hash->slots[*pos];
+                if (slot->key == HASH_EMPTY) continue;
+                if (key) *key = slot->key;
+                if (value) *value = slot->value;
+                (*pos)++;
+                return True;
+        }
+        return False;
+}
+
+void hash_delete(struct hash *hash)
+{
+        free(hash->slots);
+        free(hash);
+}
+
+static void set_init_keys(struct hash_set *set, unsigned size)
+{
+        myallocn(set->keys, size);
+        for (unsigned i = 0; i < size; i++)
+                set->keys[i] = HASH_EMPTY;
+        set->mask = size - 1;
+}
+
+struct hash_set *hash_set_new(void)
+{
+        struct hash_set *set;
+        myalloc(set);
+        set_init_keys(set, INITIAL_SIZE);
+        return set;
+}
+
+unsigned hash_set_len(struct hash_set *set)
+{
+        return set->len;
+}
+
+static uint64_t *set_find(struct hash_set *set, uint64_t key)
+{
+        unsigned i = mix(key) & set->mask;
+        while (set->keys[i] != key && set->keys[i] != HASH_EMPTY)
+                i = (i + 1) & set->mask;
+        return &set->keys[i];
+}
+
+bool hash_set_has(struct hash_set *set, uint64_t key)
+{
+        return *set_find(set, key) == key;
+}
+
+static void set_resize(struct hash_set *set)
+{
+        uint64_t *old = set->keys;
+        unsigned size = set->mask + 1;
+
+        set_init_keys(set, size << 1);
+        for (unsigned i = 0; i < size; i++)
+                if (old[i] != HASH_EMPTY) *set_find(set, old[i]) = old[i];
+        free(old);
+}
+
+bool hash_set_add(struct hash_set *set, uint64_t key)
+{
+        uint64_t *slot;
+
+        if (key == HASH_EMPTY) die();
+
+        slot = set_find(set, key);
+        if (*slot == key) return False;
+        /* Sets can be huge, so they are allowed to get fuller */
+        if (4 * (set->len + 1) > 3 * (set->mask + 1)) {
+                set_resize(set);
+                slot = set_find(set, key);
+        }
+        *slot = key;
+        set->len++;
+        return True;
+}
+
+size_t hash_set_size(struct hash_set *set)
+{
+        return (set->mask + 1) * sizeof *set->keys;
+}
+
+void hash_set_delete(struct hash_set *set)
+{
+        free(set->keys);
+        free(set);
+}
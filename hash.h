@@ -0,0 +1,72 @@
+/*
+   hash.h: Hash table keyed by 64-bit integers, header for hash.c
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include "common.h"
+
+struct hash;
+
+/*! Keys are arbitrary 64-bit integers, except for HASH_EMPTY, which
+ *  marks unused slots.  Uses open addressing with linear probing, so
+ *  there is no per-entry allocation.
+ */
+#define HASH_EMPTY UINT64_MAX
+
+struct hash *hash_new (void);
+unsigned hash_len (struct hash *hash);
+
+//! Returns the value stored under key, or NULL if there is none
+void *hash_get (struct hash *hash, uint64_t key);
+
+//! Stores value under key, replacing any previous value
+void hash_put (struct hash *hash, uint64_t key, void *value);
+
+//! Removes key, returning its value, or NULL if it wasn't there
+void *hash_remove (struct hash *hash, uint64_t key);
+
+/*! Iterates over the entries, in no particular order.  Start with
+ *  *pos = 0.  Returns False when there are no more.  The table must
+ *  not be modified while iterating.
+ */
+bool hash_next (struct hash *hash, unsigned *pos, uint64_t *key,
+                void **value);
+
+void hash_delete (struct hash *hash);
+
+/*! A set of keys, with the same restrictions.  There are no values,
+ *  so each entry takes just 8 bytes.
+ */
+struct hash_set;
+
+struct hash_set *hash_set_new (void);
+unsigned hash_set_len (struct hash_set *set);
+bool hash_set_has (struct hash_set *set, uint64_t key);
+
+//! Adds key, returning False if it was already there
+bool hash_set_add (struct hash_set *set, uint64_t key);
+
+//! Bytes used by the table itself
+size_t hash_set_size (struct hash_set *set);
+
+void hash_set_delete (struct hash_set *set);
+
+#endif
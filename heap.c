@@ -193,6 +193,12 @@ unsigned heap_len(struct heap *heap)
         return heap->n;
 }
 
+void *heap_item(struct heap *heap, unsigned i)
+{
+        if (i >= (unsigned) heap->n) die();
+        return heap->root[i];
+}
+
 /* Test code is below here */
 
 #if 0
@@ -57,6 +57,9 @@ void *heap_extract_min (struct heap *heap);
 void heap_insert (struct heap *heap, void *v);
 void heap_delete (struct heap *heap);
 
+//! Returns the i'th item, in no particular order, for 0 <= i < heap_len()
+void *heap_item (struct heap *heap, unsigned i);
+
 //! Parameters qsort(), but with worst-case run time of O(n*lg(n))
 void heapsort (void *base, size_t nmemb, size_t size, compare_t *compare);
 
@@ -0,0 +1,107 @@
+/*
+   quantile.c: Streaming quantile estimation over a decaying histogram
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "quantile.h"
+
+struct quantile
+{
+        double lo;
+        double per_octave;
+        unsigned nbuckets;
+        double *counts;
+        double total;
+        double weight;  //!< Weight of the next sample
+        double growth;  //!< weight is multiplied by this after each sample
+        unsigned long n;
+};
+
+/* Rather than decaying every bucket on every sample, newer samples
+ * are given exponentially larger weights.  Once the weights get
+ * large, everything is scaled back down. */
+#define MAX_WEIGHT 1e100
+
+struct quantile *quantile_new(double lo, double hi, unsigned per_octave,
+                              double halflife)
+{
+        struct quantile *q;
+
+        if (lo <= 0 || hi <= lo || !per_octave || halflife <= 0) die();
+
+        myalloc(q);
+        q->lo = lo;
+        q->per_octave = per_octave;
+        q->nbuckets = ceil(log2(hi / lo) * per_octave) + 1;
+        myallocn(q->counts, q->nbuckets);
+        q->weight = 1;
+        q->growth = pow(2, 1 / halflife);
+        return q;
+}
+
+static unsigned bucket(struct quantile *q, double x)
+{
+        double b;
+        if (x <= q->lo) return 0;
+        b = ceil(log2(x / q->lo) * q->per_octave);
+        if (b >= q->nbuckets) return q->nbuckets - 1;
+        return b;
+}
+
+void quantile_add(struct quantile *q, double x)
+{
+        q->counts[bucket(q, x)] += q->weight;
+        q->total += q->weight;
+        q->n++;
+
+        q->weight *= q->growth;
+        if (q->weight > MAX_WEIGHT) {
+                for (unsigned i = 0; i < q->nbuckets; i++)
+                        q->counts[i] /= q->weight;
+                q->total /= q->weight;
+                q->weight = 1;
+        }
+}
+
+double quantile_get(struct quantile *q, double p)
+{
+        double target = p * q->total;
+        double sum = 0;
+        unsigned i;
+
+        if (!q->n) return 0;
+
+        for (i = 0; i < q->nbuckets - 1; i++) {
+                sum += q->counts[i];
+                if (sum >= target) break;
+        }
+
+        /* Upper edge of the bucket */
+        return q->lo * exp2(i / q->per_octave);
+}
+
+unsigned long quantile_count(struct quantile *q)
+{
+        return q->n;
+}
+
+void quantile_delete(struct quantile *q)
+{
+        free(q->counts);
+        free(q);
+}
@@ -0,0 +1,46 @@
+/*
+   quantile.h: Streaming quantile estimation, header for quantile.c
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef QUANTILE_H
+#define QUANTILE_H
+
+#include "common.h"
+
+struct quantile;
+
+/*! Creates an estimator for positive values between lo and hi.
+ *  Values are kept in a histogram with logarithmically-spaced
+ *  buckets, "per_octave" of them per doubling, so the relative error
+ *  of an estimate is about 2^(1/per_octave).  Old samples fade away:
+ *  a sample counts half as much after "halflife" newer samples have
+ *  been added.  Values outside [lo, hi] are clamped.
+ */
+struct quantile *quantile_new(double lo, double hi, unsigned per_octave,
+                              double halflife);
+void quantile_add(struct quantile *q, double x);
+
+//! Returns an upper bound on the p'th quantile, or 0 if empty
+double quantile_get(struct quantile *q, double p);
+
+//! Number of samples seen, ignoring decay
+unsigned long quantile_count(struct quantile *q);
+void quantile_delete(struct quantile *q);
+
+#endif
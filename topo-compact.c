@@ -0,0 +1,208 @@
+/*
+   topo-compact.c: Turns topology logs into a CSR snapshot
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "hash.h"
+#include "topo.h"
+
+/* Each peer's latest record wins, counting later logs on the command
+ * line as later.  The logs are read three times, so that memory goes
+ * to the nodes rather than the edges: once to find each peer's latest
+ * record, once to collect the nodes, and once to fill in the edges,
+ * which go straight into the mapped snapshot.
+ */
+struct latest
+{
+        uint64_t seq;           //!< Which record, counting from 0
+        unsigned num_peers, num_leaves;
+        enum topo_kind kind;
+};
+
+static char **logs;
+static int num_logs;
+
+/* Calls func on every record, in order, with its sequence number */
+static void for_each_record(void (*func) (uint64_t seq,
+                                          struct topo_record *r))
+{
+        struct topo_record r;
+        uint64_t seq = 0;
+
+        for (int i = 0; i < num_logs; i++) {
+                struct topo *topo = topo_open(logs[i]);
+                if (!topo) {
+                        perror(logs[i]);
+                        exit(1);
+                }
+                while (topo_read(topo, &r)) func(seq++, &r);
+                topo_close(topo);
+        }
+}
+
+static struct hash *latest;
+static int64_t last_time = 0;
+
+static void find_latest(uint64_t seq, struct topo_record *r)
+{
+        struct latest *l = hash_get(latest, r->ep);
+
+        if (!l) {
+                myalloc(l);
+                hash_put(latest, r->ep, l);
+        }
+        l->seq = seq;
+        l->num_peers = r->num_peers;
+        l->num_leaves = r->num_leaves;
+        l->kind = r->kind;
+        last_time = max(last_time, r->time);
+}
+
+static bool is_latest(uint64_t seq, struct topo_record *r)
+{
+        struct latest *l = hash_get(latest, r->ep);
+        return l->seq == seq;
+}
+
+static struct hash_set *seen;
+static endpoint_t *nodes;
+static uint64_t num_nodes, max_nodes;
+
+static void add_node(endpoint_t ep)
+{
+        if (!hash_set_add(seen, ep)) return;
+        grow(nodes, max_nodes, num_nodes);
+        nodes[num_nodes++] = ep;
+}
+
+static void collect_nodes(uint64_t seq, struct topo_record *r)
+{
+        if (!is_latest(seq, r)) return;
+        add_node(r->ep);
+        for (unsigned i = 0; i < r->num_peers; i++) add_node(r->peers[i]);
+        for (unsigned i = 0; i < r->num_leaves; i++) add_node(r->leaves[i]);
+}
+
+static int endpoint_cmp(const void *v1, const void *v2)
+{
+        const endpoint_t *ep1 = v1, *ep2 = v2;
+        return cmp3(*ep1, *ep2);
+}
+
+static struct topo_snapshot snapshot;
+
+static void fill_edges(uint64_t seq, struct topo_record *r)
+{
+        uint32_t *peers = (uint32_t *) snapshot.peers;
+        uint32_t *leaves = (uint32_t *) snapshot.leaves;
+        int64_t i;
+
+        if (!is_latest(seq, r)) return;
+        i = topo_find(&snapshot, r->ep);
+        for (unsigned j = 0; j < r->num_peers; j++)
+                peers[snapshot.peer_index[i] + j]
+                        = topo_find(&snapshot, r->peers[j]);
+        for (unsigned j = 0; j < r->num_leaves; j++)
+                leaves[snapshot.leaf_index[i] + j]
+                        = topo_find(&snapshot, r->leaves[j]);
+}
+
+int main(int argc, char *argv[])
+{
+        struct topo_snapshot_header h;
+        struct latest *l;
+        uint64_t *peer_index, *leaf_index, key;
+        unsigned pos = 0;
+        size_t size;
+        void *map;
+        int fd;
+
+        if (argc < 3) {
+                fprintf(stderr, "Usage: %s SNAPSHOT LOG...\n"
+                        "Writes the topology in the logs to SNAPSHOT, "
+                        "keeping the latest record\n"
+                        "for each peer.\n", argv[0]);
+                exit(1);
+        }
+        logs = &argv[2];
+        num_logs = argc - 2;
+
+        latest = hash_new();
+        for_each_record(find_latest);
+
+        seen = hash_set_new();
+        max_nodes = 1024;
+        myallocn(nodes, max_nodes);
+        for_each_record(collect_nodes);
+        hash_set_delete(seen);
+        qsort(nodes, num_nodes, sizeof *nodes, endpoint_cmp);
+
+        memset(&h, 0, sizeof h);
+        memcpy(h.magic, TOPO_SNAPSHOT_MAGIC, sizeof TOPO_SNAPSHOT_MAGIC);
+        h.num_nodes = num_nodes;
+        h.time = last_time;
+        while (hash_next(latest, &pos, &key, (void **) &l)) {
+                h.num_peer_edges += l->num_peers;
+                h.num_leaf_edges += l->num_leaves;
+        }
+
+        size = topo_snapshot_size(&h);
+        fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (0 > fd || 0 > ftruncate(fd, size)) {
+                perror(argv[1]);
+                exit(1);
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) die();
+        memcpy(map, &h, sizeof h);
+        if (!topo_snapshot_layout(&snapshot, map, size)) die();
+        memcpy((endpoint_t *) snapshot.nodes, nodes, num_nodes * sizeof *nodes);
+        free(nodes);
+
+        /* Degrees first, then running totals */
+        peer_index = (uint64_t *) snapshot.peer_index;
+        leaf_index = (uint64_t *) snapshot.leaf_index;
+        pos = 0;
+        while (hash_next(latest, &pos, &key, (void **) &l)) {
+                int64_t i = topo_find(&snapshot, key);
+                peer_index[i + 1] = l->num_peers;
+                leaf_index[i + 1] = l->num_leaves;
+                ((uint8_t *) snapshot.types)[i] = l->kind;
+        }
+        for (uint64_t i = 0; i < num_nodes; i++) {
+                peer_index[i + 1] += peer_index[i];
+                leaf_index[i + 1] += leaf_index[i];
+        }
+
+        for_each_record(fill_edges);
+
+        if (0 > munmap(map, size) || 0 > close(fd)) die();
+        fprintf(stderr, "%llu nodes, %llu peers, %llu leaves\n",
+                (unsigned long long) h.num_nodes,
+                (unsigned long long) h.num_peer_edges,
+                (unsigned long long) h.num_leaf_edges);
+
+        pos = 0;
+        while (hash_next(latest, &pos, &key, (void **) &l)) free(l);
+        hash_delete(latest);
+        return 0;
+}
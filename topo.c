@@ -0,0 +1,321 @@
+/*
+   topo.c: Append-only topology logs and CSR snapshots
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "topo.h"
+
+#define MAGIC "IONTOP1\n"
+#define TOPO_TIME 'T'
+#define DEFAULT_PORT 6346
+
+struct topo
+{
+        FILE *f;
+        int64_t last;           //!< Time of the previous record, in ms
+        bool started;
+        bool eof;
+
+        /* Buffers for topo_read() */
+        endpoint_t *peers, *leaves;
+        unsigned peers_max, leaves_max;
+};
+
+static struct topo *topo_new(FILE *f)
+{
+        struct topo *topo;
+        myalloc(topo);
+        topo->f = f;
+        topo->peers_max = topo->leaves_max = 16;
+        myallocn(topo->peers, topo->peers_max);
+        myallocn(topo->leaves, topo->leaves_max);
+        return topo;
+}
+
+struct topo *topo_open(const char *path)
+{
+        char magic[sizeof MAGIC - 1];
+        FILE *f = fopen(path, "r");
+
+        if (!f) return NULL;
+        if (1 != fread(magic, sizeof magic, 1, f)
+            || memcmp(magic, MAGIC, sizeof magic)) {
+                fclose(f);
+                errno = EINVAL;
+                return NULL;
+        }
+        return topo_new(f);
+}
+
+/* A run that was killed may have left its last record cut short.
+ * Everything after the last whole record is dropped before appending,
+ * so that the records that follow can still be read. */
+struct topo *topo_create(const char *path)
+{
+        char magic[sizeof MAGIC - 1];
+        struct topo_record r;
+        struct topo *topo;
+        long end = 0;
+        int fd = open(path, O_RDWR | O_CREAT, 0666);
+        FILE *f;
+
+        if (0 > fd) return NULL;
+        if (!(f = fdopen(fd, "r+"))) die();
+        topo = topo_new(f);
+        if (1 == fread(magic, sizeof magic, 1, f)) {
+                if (memcmp(magic, MAGIC, sizeof magic)) {
+                        topo_close(topo);
+                        errno = EINVAL;
+                        return NULL;
+                }
+                end = ftell(f);
+                while (topo_read(topo, &r)) end = ftell(f);
+                topo->eof = False;
+        }
+        if (0 > ftruncate(fd, end) || 0 > fseek(f, end, SEEK_SET)) die();
+        if (!end && 1 != fwrite(MAGIC, sizeof MAGIC - 1, 1, f)) die();
+        return topo;
+}
+
+static void put_varint(FILE *f, uint64_t x)
+{
+        while (x >= 0x80) {
+                putc((x & 0x7f) | 0x80, f);
+                x >>= 7;
+        }
+        putc(x, f);
+}
+
+static void put_endpoint(FILE *f, endpoint_t ep)
+{
+        for (int shift = 40; shift >= 0; shift -= 8)
+                putc((ep >> shift) & 0xff, f);
+}
+
+static int endpoint_cmp(const void *v1, const void *v2)
+{
+        const endpoint_t *ep1 = v1, *ep2 = v2;
+        return cmp3(*ep1, *ep2);
+}
+
+static void put_endpoints(FILE *f, endpoint_t *eps, unsigned n)
+{
+        uint32_t ip = 0;
+        unsigned port = DEFAULT_PORT;
+
+        qsort(eps, n, sizeof *eps, endpoint_cmp);
+        put_varint(f, n);
+        for (unsigned i = 0; i < n; i++) {
+                bool new_port = endpoint_port(eps[i]) != port;
+                put_varint(f, (uint64_t) (endpoint_ip(eps[i]) - ip) << 1
+                           | new_port);
+                if (new_port) put_varint(f, endpoint_port(eps[i]));
+                ip = endpoint_ip(eps[i]);
+                port = endpoint_port(eps[i]);
+        }
+}
+
+void topo_write(struct topo *topo, struct topo_record *r)
+{
+        FILE *f = topo->f;
+
+        if (!topo->started) {
+                putc(TOPO_TIME, f);
+                put_varint(f, max(0, r->time));
+                topo->last = r->time;
+                topo->started = True;
+        }
+
+        putc(r->kind, f);
+        put_varint(f, max(0, r->time - topo->last));
+        topo->last = max(topo->last, r->time);
+        put_endpoint(f, r->ep);
+        put_endpoints(f, r->peers, r->num_peers);
+        put_endpoints(f, r->leaves, r->num_leaves);
+        if (ferror(f)) die();
+}
+
+void topo_flush(struct topo *topo)
+{
+        if (fflush(topo->f)) die();
+}
+
+static int get_byte(struct topo *topo)
+{
+        int c = getc(topo->f);
+        if (c == EOF) topo->eof = True;
+        return c;
+}
+
+static uint64_t get_varint(struct topo *topo)
+{
+        uint64_t x = 0;
+        int c;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (EOF == (c = get_byte(topo))) return 0;
+                x |= (uint64_t) (c & 0x7f) << shift;
+                if (!(c & 0x80)) return x;
+        }
+        die();
+}
+
+static endpoint_t get_endpoint(struct topo *topo)
+{
+        endpoint_t ep = 0;
+        int c;
+
+        for (int i = 0; i < 6; i++) {
+                if (EOF == (c = get_byte(topo))) return 0;
+                ep = (ep << 8) | c;
+        }
+        return ep;
+}
+
+static endpoint_t *get_endpoints(struct topo *topo, endpoint_t **eps,
+                                 unsigned *max, unsigned *n)
+{
+        uint32_t ip = 0;
+        unsigned port = DEFAULT_PORT;
+
+        *n = get_varint(topo);
+        if (topo->eof) *n = 0;
+        grow(*eps, *max, *n);
+        for (unsigned i = 0; i < *n && !topo->eof; i++) {
+                uint64_t x = get_varint(topo);
+                ip += x >> 1;
+                if (x & 1) port = get_varint(topo);
+                if (port > 0xffff) die();
+                (*eps)[i] = endpoint_make(ip, port);
+        }
+        return *eps;
+}
+
+bool topo_read(struct topo *topo, struct topo_record *r)
+{
+        int kind;
+
+        while (TOPO_TIME == (kind = get_byte(topo)))
+                topo->last = get_varint(topo);
+        if (kind == EOF) return False;
+
+        memset(r, 0, sizeof *r);
+        r->kind = kind;
+        if (kind != TOPO_ULTRAPEER && kind != TOPO_LEAF && kind != TOPO_PEER)
+                die();
+        topo->last += get_varint(topo);
+        r->time = topo->last;
+        r->ep = get_endpoint(topo);
+        r->peers = get_endpoints(topo, &topo->peers, &topo->peers_max,
+                                 &r->num_peers);
+        r->leaves = get_endpoints(topo, &topo->leaves, &topo->leaves_max,
+                                  &r->num_leaves);
+        return !topo->eof;
+}
+
+void topo_close(struct topo *topo)
+{
+        if (fclose(topo->f)) die();
+        free(topo->peers);
+        free(topo->leaves);
+        free(topo);
+}
+
+size_t topo_snapshot_size(const struct topo_snapshot_header *h)
+{
+        return sizeof *h
+                + h->num_nodes * sizeof (endpoint_t)
+                + 2 * (h->num_nodes + 1) * sizeof (uint64_t)
+                + (h->num_peer_edges + h->num_leaf_edges) * sizeof (uint32_t)
+                + h->num_nodes;
+}
+
+bool topo_snapshot_layout(struct topo_snapshot *s, void *map, size_t size)
+{
+        const struct topo_snapshot_header *h = map;
+        const char *p = map;
+
+        if (size < sizeof *h
+            || memcmp(h->magic, TOPO_SNAPSHOT_MAGIC, sizeof h->magic)
+            || size != topo_snapshot_size(h))
+                return False;
+
+        s->map = map;
+        s->size = size;
+        s->num_nodes = h->num_nodes;
+        s->time = h->time;
+        p += sizeof *h;
+        s->nodes = (const endpoint_t *) p;
+        p += h->num_nodes * sizeof (endpoint_t);
+        s->peer_index = (const uint64_t *) p;
+        p += (h->num_nodes + 1) * sizeof (uint64_t);
+        s->leaf_index = (const uint64_t *) p;
+        p += (h->num_nodes + 1) * sizeof (uint64_t);
+        s->peers = (const uint32_t *) p;
+        p += h->num_peer_edges * sizeof (uint32_t);
+        s->leaves = (const uint32_t *) p;
+        p += h->num_leaf_edges * sizeof (uint32_t);
+        s->types = (const uint8_t *) p;
+        return True;
+}
+
+struct topo_snapshot *topo_snapshot_open(const char *path)
+{
+        struct topo_snapshot *s;
+        struct stat st;
+        void *map;
+        int fd = open(path, O_RDONLY);
+
+        if (0 > fd) return NULL;
+        if (0 > fstat(fd, &st)) die();
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return NULL;
+
+        myalloc(s);
+        if (!topo_snapshot_layout(s, map, st.st_size)) {
+                munmap(map, st.st_size);
+                free(s);
+                errno = EINVAL;
+                return NULL;
+        }
+        return s;
+}
+
+int64_t topo_find(const struct topo_snapshot *s, endpoint_t ep)
+{
+        uint64_t lo = 0, hi = s->num_nodes;
+
+        while (lo < hi) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if (s->nodes[mid] < ep) lo = mid + 1;
+                else hi = mid;
+        }
+        return lo < s->num_nodes && s->nodes[lo] == ep ? (int64_t) lo : -1;
+}
+
+void topo_snapshot_close(struct topo_snapshot *s)
+{
+        munmap(s->map, s->size);
+        free(s);
+}
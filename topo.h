@@ -0,0 +1,139 @@
+/*
+   topo.h: Append-only topology logs and CSR snapshots, header for
+   topo.c
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TOPO_H
+#define TOPO_H
+
+#include "common.h"
+#include "endpoint.h"
+
+/* A topology log is the magic string "IONTOP1\n" followed by records,
+ * and may be appended to by any number of runs.  Each run starts with
+ * a time record: 'T' and the time in milliseconds since the epoch, as
+ * a varint (7 bits per byte, low bits first).  Every other record is
+ * a peer type byte, the milliseconds since the previous record as a
+ * varint, the peer's endpoint as 6 big-endian bytes, then its
+ * neighbors and its leaves.
+ *
+ * A list of endpoints is its length as a varint, then the endpoints
+ * in sorted order.  Each is a varint of the difference from the
+ * previous IP address, shifted left one bit, with the low bit set if
+ * the port differs from the previous port.  If it does, the port
+ * follows as a varint.  The first entry is relative to 0.0.0.0:6346.
+ * Neighbors of the same peer are usually scattered across the address
+ * space, so this mostly saves on the port and the high bits.
+ */
+enum topo_kind
+{
+        TOPO_ULTRAPEER = 'U',
+        TOPO_LEAF = 'L',
+        TOPO_PEER = 'P',
+};
+
+struct topo_record
+{
+        enum topo_kind kind;
+        int64_t time;           //!< Milliseconds since the epoch
+        endpoint_t ep;
+        endpoint_t *peers;
+        unsigned num_peers;
+        endpoint_t *leaves;
+        unsigned num_leaves;
+};
+
+struct topo;
+
+/*! Opens a log for appending, first dropping any record cut short at
+ *  its end.  Returns NULL and sets errno on failure.
+ */
+struct topo *topo_create (const char *path);
+
+//! Sorts the record's endpoint lists in place, and appends it
+void topo_write (struct topo *topo, struct topo_record *r);
+
+void topo_flush (struct topo *topo);
+
+//! Returns NULL and sets errno if the file can't be opened
+struct topo *topo_open (const char *path);
+
+/*! Reads the next record.  The record's pointers are only good until
+ *  the next call.  Returns False at the end of the log, including a
+ *  record cut short by a killed writer; dies if it is corrupt.
+ */
+bool topo_read (struct topo *topo, struct topo_record *r);
+
+void topo_close (struct topo *topo);
+
+/* A snapshot is the graph in compressed sparse row form, made by
+ * topo-compact from the latest record for each peer.  It is laid out
+ * in native byte order so that it can be used straight from mmap():
+ * the header, then these arrays, in order:
+ *
+ *   endpoint_t nodes[num_nodes]             sorted, for topo_find()
+ *   uint64_t peer_index[num_nodes + 1]      node i's neighbors are
+ *   uint64_t leaf_index[num_nodes + 1]        peers[peer_index[i]] up
+ *   uint32_t peers[num_peer_edges]            to peers[peer_index[i+1]],
+ *   uint32_t leaves[num_leaf_edges]           as node numbers; the same
+ *   uint8_t types[num_nodes]                  for leaves
+ *
+ * A node's type is its topo_kind, or 0 if it was only ever seen as
+ * somebody's neighbor.
+ */
+#define TOPO_SNAPSHOT_MAGIC "IONCSR1"
+
+struct topo_snapshot_header
+{
+        char magic[8];
+        uint64_t num_nodes;
+        uint64_t num_peer_edges;
+        uint64_t num_leaf_edges;
+        int64_t time;           //!< Of the latest record, in ms since the epoch
+};
+
+struct topo_snapshot
+{
+        void *map;
+        size_t size;
+        uint64_t num_nodes;
+        int64_t time;
+        const endpoint_t *nodes;
+        const uint64_t *peer_index, *leaf_index;
+        const uint32_t *peers, *leaves;
+        const uint8_t *types;
+};
+
+//! Size of a snapshot file with the header's counts
+size_t topo_snapshot_size (const struct topo_snapshot_header *h);
+
+/*! Points the snapshot's arrays into a mapped file.  Returns False if
+ *  it isn't a snapshot or is the wrong size.
+ */
+bool topo_snapshot_layout (struct topo_snapshot *s, void *map, size_t size);
+
+//! Maps a snapshot.  Returns NULL and sets errno on failure.
+struct topo_snapshot *topo_snapshot_open (const char *path);
+
+//! Returns the node number of ep, or -1 if it isn't in the snapshot
+int64_t topo_find (const struct topo_snapshot *s, endpoint_t ep);
+
+void topo_snapshot_close (struct topo_snapshot *s);
+
+#endif
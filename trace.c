@@ -0,0 +1,243 @@
+/*
+   trace.c: Binary traces of plug-in requests and results
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <errno.h>
+#include "trace.h"
+
+#define MAGIC "IONTRC1\n"
+
+struct trace
+{
+        FILE *f;
+        int64_t last;           //!< Time of the previous record, in us
+        bool started;
+        bool eof;
+
+        /* Buffers for trace_read() */
+        char *text;
+        size_t text_max;
+        endpoint_t *peers, *leaves;
+        unsigned peers_max, leaves_max;
+};
+
+static struct trace *trace_new(FILE *f)
+{
+        struct trace *trace;
+        myalloc(trace);
+        trace->f = f;
+        trace->text_max = 64;
+        myallocn(trace->text, trace->text_max);
+        trace->peers_max = trace->leaves_max = 16;
+        myallocn(trace->peers, trace->peers_max);
+        myallocn(trace->leaves, trace->leaves_max);
+        return trace;
+}
+
+struct trace *trace_create(const char *path)
+{
+        FILE *f = fopen(path, "w");
+        if (!f) return NULL;
+        if (1 != fwrite(MAGIC, sizeof MAGIC - 1, 1, f)) die();
+        return trace_new(f);
+}
+
+struct trace *trace_open(const char *path)
+{
+        char magic[sizeof MAGIC - 1];
+        FILE *f = fopen(path, "r");
+
+        if (!f) return NULL;
+        if (1 != fread(magic, sizeof magic, 1, f)
+            || memcmp(magic, MAGIC, sizeof magic)) {
+                fclose(f);
+                errno = EINVAL;
+                return NULL;
+        }
+        return trace_new(f);
+}
+
+static void put_varint(FILE *f, uint64_t x)
+{
+        while (x >= 0x80) {
+                putc((x & 0x7f) | 0x80, f);
+                x >>= 7;
+        }
+        putc(x, f);
+}
+
+static void put_endpoint(FILE *f, endpoint_t ep)
+{
+        for (int shift = 40; shift >= 0; shift -= 8)
+                putc((ep >> shift) & 0xff, f);
+}
+
+static void put_string(FILE *f, const char *s)
+{
+        size_t len = s ? strlen(s) : 0;
+        put_varint(f, len);
+        if (len && 1 != fwrite(s, len, 1, f)) die();
+}
+
+static void put_endpoints(FILE *f, const endpoint_t *eps, unsigned n)
+{
+        put_varint(f, n);
+        for (unsigned i = 0; i < n; i++) put_endpoint(f, eps[i]);
+}
+
+void trace_write(struct trace *trace, const struct trace_record *r)
+{
+        FILE *f = trace->f;
+        int64_t now = r->time / 1000;
+
+        if (!trace->started) {
+                trace->last = now;
+                trace->started = True;
+        }
+
+        putc(r->kind, f);
+        put_varint(f, max(0, now - trace->last));
+        trace->last = max(trace->last, now);
+        put_endpoint(f, r->ep);
+
+        switch (r->kind) {
+        case TRACE_REQUEST:
+                putc(r->lane, f);
+                break;
+        case TRACE_FAILURE:
+                put_varint(f, r->duration / 1000);
+                put_string(f, r->text);
+                break;
+        case TRACE_ULTRAPEER:
+        case TRACE_LEAF:
+        case TRACE_PEER:
+                put_varint(f, r->duration / 1000);
+                put_string(f, r->text);
+                put_endpoints(f, r->peers, r->num_peers);
+                put_endpoints(f, r->leaves, r->num_leaves);
+                break;
+        default: die();
+        }
+        if (ferror(f)) die();
+}
+
+void trace_flush(struct trace *trace)
+{
+        if (fflush(trace->f)) die();
+}
+
+/* A record cut short by the end of the file is taken to be the end of
+ * the trace, since that's what a trace from a killed process has. */
+static int get_byte(struct trace *trace)
+{
+        int c = getc(trace->f);
+        if (c == EOF) trace->eof = True;
+        return c;
+}
+
+static uint64_t get_varint(struct trace *trace)
+{
+        uint64_t x = 0;
+        int c;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (EOF == (c = get_byte(trace))) return 0;
+                x |= (uint64_t) (c & 0x7f) << shift;
+                if (!(c & 0x80)) return x;
+        }
+        die();
+}
+
+static endpoint_t get_endpoint(struct trace *trace)
+{
+        endpoint_t ep = 0;
+        int c;
+
+        for (int i = 0; i < 6; i++) {
+                if (EOF == (c = get_byte(trace))) return 0;
+                ep = (ep << 8) | c;
+        }
+        return ep;
+}
+
+static char *get_string(struct trace *trace)
+{
+        size_t len = get_varint(trace);
+
+        grow(trace->text, trace->text_max, len);
+        if (len && 1 != fread(trace->text, len, 1, trace->f))
+                trace->eof = True;
+        trace->text[len] = 0;
+        return trace->text;
+}
+
+static endpoint_t *get_endpoints(struct trace *trace, endpoint_t **eps,
+                                 unsigned *max, unsigned *n)
+{
+        *n = get_varint(trace);
+        if (trace->eof) *n = 0;
+        grow(*eps, *max, *n);
+        for (unsigned i = 0; i < *n && !trace->eof; i++)
+                (*eps)[i] = get_endpoint(trace);
+        return *eps;
+}
+
+bool trace_read(struct trace *trace, struct trace_record *r)
+{
+        int kind = get_byte(trace);
+
+        if (kind == EOF) return False;
+
+        memset(r, 0, sizeof *r);
+        r->kind = kind;
+        trace->last += get_varint(trace);
+        r->time = trace->last * 1000;
+        r->ep = get_endpoint(trace);
+
+        switch (r->kind) {
+        case TRACE_REQUEST:
+                r->lane = get_byte(trace);
+                break;
+        case TRACE_FAILURE:
+                r->duration = get_varint(trace) * 1000;
+                r->text = get_string(trace);
+                break;
+        case TRACE_ULTRAPEER:
+        case TRACE_LEAF:
+        case TRACE_PEER:
+                r->duration = get_varint(trace) * 1000;
+                r->text = get_string(trace);
+                r->peers = get_endpoints(trace, &trace->peers,
+                                         &trace->peers_max, &r->num_peers);
+                r->leaves = get_endpoints(trace, &trace->leaves,
+                                          &trace->leaves_max, &r->num_leaves);
+                break;
+        default: die();
+        }
+        return !trace->eof;
+}
+
+void trace_close(struct trace *trace)
+{
+        if (fclose(trace->f)) die();
+        free(trace->text);
+        free(trace->peers);
+        free(trace->leaves);
+        free(trace);
+}
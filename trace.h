@@ -0,0 +1,84 @@
+/*
+   trace.h: Binary traces of plug-in requests and results, header for
+   trace.c
+
+   Copyright (C) 2009 Daniel Stutzbach
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+#include "endpoint.h"
+
+/* A trace is the magic string "IONTRC1\n" followed by records.  Every
+ * record starts with a kind byte, the time since the previous record
+ * in microseconds as a varint (7 bits per byte, low bits first), and
+ * the endpoint as 6 big-endian bytes.  Then, by kind:
+ *
+ *   TRACE_REQUEST: the lane, 1 byte
+ *   TRACE_FAILURE: the duration in microseconds, varint; the message,
+ *                  as a varint length and that many bytes
+ *   TRACE_ULTRAPEER, TRACE_LEAF, TRACE_PEER:
+ *                  the duration, varint; the user agent, like the
+ *                  message above; the number of neighbors, varint,
+ *                  then 6 bytes each; the same for leaves
+ */
+enum trace_kind
+{
+        TRACE_REQUEST = 'Q',
+        TRACE_FAILURE = 'F',
+        TRACE_ULTRAPEER = 'U',
+        TRACE_LEAF = 'L',
+        TRACE_PEER = 'P',
+};
+
+struct trace_record
+{
+        enum trace_kind kind;
+        int64_t time;           //!< Nanoseconds, on any consistent clock
+        endpoint_t ep;
+        unsigned lane;
+        int64_t duration;       //!< Nanoseconds from connecting to the result
+        char *text;             //!< User agent or failure message
+        endpoint_t *peers;
+        unsigned num_peers;
+        endpoint_t *leaves;
+        unsigned num_leaves;
+};
+
+struct trace;
+
+//! Returns NULL and sets errno if the file can't be created
+struct trace *trace_create (const char *path);
+void trace_write (struct trace *trace, const struct trace_record *r);
+
+//! Pushes buffered records out to the file
+void trace_flush (struct trace *trace);
+
+//! Returns NULL and sets errno if the file can't be opened
+struct trace *trace_open (const char *path);
+
+/*! Reads the next record, with times measured from the start of the
+ *  trace.  The record's pointers are only good until the next call.
+ *  Returns False at the end of the trace; dies if it is corrupt.
+ */
+bool trace_read (struct trace *trace, struct trace_record *r);
+
+void trace_close (struct trace *trace);
+
+#endif